@@ -0,0 +1,666 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <cmath>
+#include <atomic>
+
+// GLM
+#include <glm/glm.hpp>
+
+#include <SOIL/SOIL.h>
+
+// Other includes
+#include "Cubemap.h"
+#include "DeflectionTable.h"
+#include "RayPacket.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+// Double-precision CPU port of blackhole.frag. Every struct and function below mirrors the
+// GLSL one of the same name, so the images written here are the reference the GPU shader
+// (and any faster CPU path) is checked against.
+
+// How RenderPixel follows a ray
+enum Integrator {
+    SPHERE_TRACE,   // straight-line RayMarch loop (the original shader)
+    FIXED_STEP,     // Dormand-Prince steps of constant length StepSize
+    DORMAND_PRINCE, // RK45 with per-ray error control (RayMarchRK45 in blackhole.frag)
+    LOOKUP_TABLE    // one fetch from a DeflectionTable (RayLookup in blackhole.frag)
+};
+
+// World space position of the hole. The camera starts at the origin looking down -Z,
+// so it first sees the hole straight ahead at a distance of 6.
+const glm::dvec3 HOLE_POSITION = glm::dvec3(0.0, 0.0, -6.0);
+
+// Same as the #defines at the top of blackhole.frag
+struct MarchSettings {
+    int MaxSteps = 100;
+    double MaxDist = 100.0;
+    double SurfDist = 0.01;
+    // Geodesic integrators
+    int MaxGeodesicSteps = 300;
+    double Tolerance = 1e-5;
+    double StepSize = 0.05;
+    // Impact parameter, in Schwarzschild radii, above which RayMarchRK45 uses the weak-field
+    // deflection instead of integrating (0 integrates every ray, Far_Field is off in the shader too)
+    double FarField = 0.0;
+};
+
+// Integrator settings for deflection tables: they are traced once, so with a much tighter
+// tolerance than a per-pixel integrator could afford, and without the weak-field shortcut
+inline MarchSettings DeflectionTableSettings()
+{
+    MarchSettings march;
+    march.Tolerance = 1e-9;
+    march.MaxGeodesicSteps = 10000;
+    march.FarField = 0.0;
+    return march;
+}
+
+// Same layout as the Camera uniform in blackhole.frag
+struct RayCamera {
+    glm::dvec3 lower_left_corner;
+    glm::dvec3 horizontal;
+    glm::dvec3 vertical;
+    glm::dvec3 origin;
+};
+
+struct Ray {
+    glm::dvec3 origin;
+    glm::dvec3 direction;
+};
+
+struct Sphere {
+    glm::dvec3 center;
+    double radius;
+};
+
+// What a ray ended up doing: escaped to the skybox along direction (view space) or not,
+// and how many integration steps (accepted or rejected) that took
+struct TraceResult {
+    bool escaped;
+    glm::dvec3 direction;
+    int steps;
+};
+
+// RGB8 image, first row is the top of the screen
+struct Image {
+    int Width;
+    int Height;
+    vector<unsigned char> Pixels;
+
+    Image(int width, int height) : Width(width), Height(height), Pixels(3 * width * height, 0)
+    {
+    }
+
+    void SetPixel(int x, int y, glm::dvec3 color)
+    {
+        color = glm::clamp(color, 0.0, 1.0);
+        unsigned char* p = &this->Pixels[3 * (y * this->Width + x)];
+        p[0] = (unsigned char)(color.r * 255.0 + 0.5);
+        p[1] = (unsigned char)(color.g * 255.0 + 0.5);
+        p[2] = (unsigned char)(color.b * 255.0 + 0.5);
+    }
+
+    // Reads any image SOIL can decode (e.g. a frame written by Save), converted to RGB8
+    bool Load(const string& path)
+    {
+        int width, height;
+        unsigned char* pixels = SOIL_load_image(path.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
+        if (!pixels) {
+            cout << "ERROR::IMAGE::NOT_LOADED " << path << endl;
+            return false;
+        }
+        this->Width = width;
+        this->Height = height;
+        this->Pixels.assign(pixels, pixels + 3 * width * height);
+        SOIL_free_image_data(pixels);
+        return true;
+    }
+
+    // Writes the image as .bmp, .tga or .dds depending on the file extension
+    bool Save(const string& path) const
+    {
+        int type = SOIL_SAVE_TYPE_BMP;
+        if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".tga") == 0)
+            type = SOIL_SAVE_TYPE_TGA;
+        else if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".dds") == 0)
+            type = SOIL_SAVE_TYPE_DDS;
+        if (!SOIL_save_image(path.c_str(), type, this->Width, this->Height, 3, &this->Pixels[0])) {
+            cout << "ERROR::IMAGE::NOT_SAVED " << path << endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Result of the geometry pass, like the G-buffer of blackhole.cpp: per pixel the escaped world
+// space direction before the skybox rotation (xyz) and 1 if the ray escaped, 0 if it was
+// captured (w). First row is the top of the screen.
+struct GeometryBuffer {
+    int Width;
+    int Height;
+    vector<glm::dvec4> Texels;
+
+    GeometryBuffer(int width, int height) : Width(width), Height(height), Texels(width * height, glm::dvec4(0.0))
+    {
+    }
+};
+
+// Builds the camera uniform the same way the game loop in blackhole.cpp does
+// (zoom is Camera::Zoom, passed to tan() as is)
+inline RayCamera CreateRayCamera(double zoom, double aspect, double near = 1.0)
+{
+    RayCamera camera;
+    camera.horizontal = glm::dvec3(2 * near * tan(zoom / 2), 0.0, 0.0);
+    camera.vertical = glm::dvec3(0.0, (1 / aspect) * camera.horizontal.x, 0.0);
+    camera.lower_left_corner = glm::dvec3(-camera.horizontal.x / 2, -camera.vertical.y / 2, -near);
+    camera.origin = glm::dvec3(0.0);
+    return camera;
+}
+
+// Same matrix as the rotateVec3 blackhole.frag used to build per pixel (including its
+// column-major argument order)
+inline glm::dvec3 rotateVec3(glm::dvec3 v, glm::dvec3 axis, double theta)
+{
+    glm::dvec4 v1 = glm::dvec4(v, 1.0);
+    double c = cos(theta),
+        s = sin(theta),
+        p = 1 - cos(theta);
+    glm::dvec3 a = axis;
+    glm::dmat4 rotate = glm::dmat4(
+        c + pow(a.x, 2) * p, a.x * a.y * p - a.z * s, a.x * a.z * p + a.y * s, 0,
+        a.y * a.x * p + a.z * s, c + pow(a.y, 2) * p, a.y * a.z * p - a.x * s, 0,
+        a.z * a.x * p - a.y * s, a.z * a.y * p + a.x * s, c + pow(a.z, 2) * p, 0,
+        0, 0, 0, 1
+    );
+
+    return glm::dvec3(rotate * v1);
+}
+
+// The skybox rotation at a time as a matrix, the skyRotation uniform of blackhole.frag
+inline glm::dmat3 SkyRotation(double time)
+{
+    return glm::dmat3(
+        rotateVec3(glm::dvec3(1, 0, 0), glm::dvec3(0, 1, 0), time),
+        rotateVec3(glm::dvec3(0, 1, 0), glm::dvec3(0, 1, 0), time),
+        rotateVec3(glm::dvec3(0, 0, 1), glm::dvec3(0, 1, 0), time));
+}
+
+class CpuRenderer
+{
+public:
+    // Uniforms of blackhole.frag
+    RayCamera Eye;
+    glm::dmat3 InverseView;
+    double Time;
+    const Cubemap* Skybox;
+    // Scene and loop constants, Hole.center is in view space and Hole.radius is the
+    // Schwarzschild radius
+    Sphere Hole;
+    MarchSettings March;
+    Integrator Method;
+    // Deflection table used by LOOKUP_TABLE, see BuildDeflectionTable()
+    const DeflectionTable* Table;
+    // Integration steps taken by all rays since the last ResetStats()
+    mutable atomic<long long> StepCount;
+    mutable atomic<long long> RayCount;
+    // March PACKET_SIZE rays at a time in single precision instead of one ray in double
+    bool UsePackets;
+    // Edge length in pixels of the tiles Render() hands to the thread pool
+    int TileSize;
+    // Coarse-to-fine tracing, see TraceGeometry(): edge length in pixels of the blocks that
+    // are classified from their corner rays (0 traces every pixel), and the angle in radians
+    // by which a block's center ray may miss the interpolated direction
+    int CoarseTile;
+    double CoarseTolerance;
+
+    CpuRenderer(const Cubemap* skybox, const RayCamera& eye, const glm::dmat3& view, double time)
+        : Eye(eye), InverseView(glm::inverse(view)), Time(time), Skybox(skybox), Method(DORMAND_PRINCE), Table(nullptr), StepCount(0), RayCount(0), UsePackets(false), TileSize(32), CoarseTile(0), CoarseTolerance(1e-5)
+    {
+        this->Hole.center = view * HOLE_POSITION;
+        this->Hole.radius = 0.1;
+    }
+
+    Ray CreateRay(double u, double v) const
+    {
+        Ray ray;
+        ray.origin = this->Eye.origin;
+        ray.direction = this->Eye.lower_left_corner + u * this->Eye.horizontal + v * this->Eye.vertical - this->Eye.origin;
+        return ray;
+    }
+
+    double GetDist(glm::dvec3 p) const
+    {
+        return glm::length(p - this->Hole.center) - this->Hole.radius;
+    }
+
+    // Sphere tracing loop of RayMarch() in blackhole.frag, without the skybox fetch
+    TraceResult RayMarch(const Ray& ray) const
+    {
+        TraceResult result;
+        result.escaped = false;
+        result.direction = ray.direction;
+        result.steps = 0;
+
+        double d0 = 0.;
+        for (int i = 0; i < this->March.MaxSteps; i++)
+        {
+            result.steps++;
+            glm::dvec3 p = ray.origin + ray.direction * d0;
+            double ds = this->GetDist(p);
+            d0 += ds;
+            if (d0 > this->March.MaxDist) {
+                result.escaped = true;
+                break;
+            }
+            if (d0 < this->March.SurfDist) {
+                break;
+            }
+        }
+        return result;
+    }
+
+    // Photon acceleration around the hole. With h = |x cross v| conserved, the orbit equation of
+    // a Schwarzschild null geodesic becomes x'' = -3/2 rs h^2 x / r^5 in flat coordinates.
+    glm::dvec3 GeodesicAccel(glm::dvec3 x, double h2) const
+    {
+        double r2 = glm::dot(x, x);
+        return -1.5 * this->Hole.radius * h2 * x / (r2 * r2 * sqrt(r2));
+    }
+
+    // Deflection of a ray with impact parameter b that starts at angle psi to the hole,
+    // expanded to second order in rs / b. The error is about 5 (rs / b)^3: 2e-4 rad at 30 rs.
+    double WeakFieldDeflection(double b, double psi) const
+    {
+        double q = this->Hole.radius / b;
+        double c = cos(psi);
+        return 0.5 * q * (2.0 + 3.0 * c - c * c * c)
+            + q * q * (120.0 * (3.14159265358979323846 - psi) - 48.0 * sin(psi) + 69.0 * sin(2.0 * psi)
+                + 16.0 * sin(3.0 * psi) - 6.0 * sin(4.0 * psi) + sin(6.0 * psi)) / 128.0;
+    }
+
+    // Bends the ray around the hole with Dormand-Prince 5(4) steps. With adaptive set the step
+    // length follows the embedded error estimate (Tolerance), otherwise it is StepSize.
+    // The ray is captured inside the horizon and escapes once it leaves Max_Dist outward.
+    // Rays the impact parameter already decides are not integrated: below the critical
+    // 3 sqrt(3) / 2 rs an incoming ray from outside the photon sphere always falls in, and
+    // above FarField the weak-field deflection is used.
+    TraceResult RayMarchRK45(const Ray& ray, bool adaptive = true) const
+    {
+        TraceResult result;
+        result.escaped = false;
+        result.steps = 0;
+
+        glm::dvec3 x = ray.origin - this->Hole.center;
+        glm::dvec3 v = glm::normalize(ray.direction);
+        double h2 = glm::dot(glm::cross(x, v), glm::cross(x, v));
+
+        double r0 = glm::length(x);
+        double b = sqrt(h2);
+        if (b < 2.598076211353316 * this->Hole.radius && glm::dot(x, v) < 0.0 && r0 > 1.5 * this->Hole.radius)
+            return result;
+        if (this->March.FarField > 0.0 && b > this->March.FarField * this->Hole.radius) {
+            // Turn v towards the hole within the plane through the hole
+            glm::dvec3 e1 = -x / r0;
+            glm::dvec3 e2 = (v - glm::dot(v, e1) * e1) / (b / r0);
+            double psi = atan2(b / r0, glm::dot(v, e1));
+            double phi = psi - this->WeakFieldDeflection(b, psi);
+            result.escaped = true;
+            result.direction = cos(phi) * e1 + sin(phi) * e2;
+            return result;
+        }
+        double h = adaptive ? 0.1 * glm::length(x) : this->March.StepSize;
+        glm::dvec3 a1 = this->GeodesicAccel(x, h2);
+        // Fixed steps need at least the straight path out to Max_Dist, MaxGeodesicSteps is
+        // what is left for bending on top of that
+        int maxSteps = this->March.MaxGeodesicSteps;
+        if (!adaptive)
+            maxSteps += (int)ceil((glm::length(x) + this->March.MaxDist) / this->March.StepSize);
+
+        for (int i = 0; i < maxSteps; i++)
+        {
+            double r = glm::length(x);
+            if (r < this->Hole.radius)
+                break;
+            if (r > this->March.MaxDist && glm::dot(x, v) > 0.0) {
+                result.escaped = true;
+                break;
+            }
+            result.steps++;
+            if (adaptive)
+                h = glm::min(h, r);
+
+            glm::dvec3 v2 = v + h * (1.0 / 5.0 * a1);
+            glm::dvec3 a2 = this->GeodesicAccel(x + h * (1.0 / 5.0 * v), h2);
+            glm::dvec3 v3 = v + h * (3.0 / 40.0 * a1 + 9.0 / 40.0 * a2);
+            glm::dvec3 a3 = this->GeodesicAccel(x + h * (3.0 / 40.0 * v + 9.0 / 40.0 * v2), h2);
+            glm::dvec3 v4 = v + h * (44.0 / 45.0 * a1 - 56.0 / 15.0 * a2 + 32.0 / 9.0 * a3);
+            glm::dvec3 a4 = this->GeodesicAccel(x + h * (44.0 / 45.0 * v - 56.0 / 15.0 * v2 + 32.0 / 9.0 * v3), h2);
+            glm::dvec3 v5 = v + h * (19372.0 / 6561.0 * a1 - 25360.0 / 2187.0 * a2 + 64448.0 / 6561.0 * a3 - 212.0 / 729.0 * a4);
+            glm::dvec3 a5 = this->GeodesicAccel(x + h * (19372.0 / 6561.0 * v - 25360.0 / 2187.0 * v2 + 64448.0 / 6561.0 * v3 - 212.0 / 729.0 * v4), h2);
+            glm::dvec3 v6 = v + h * (9017.0 / 3168.0 * a1 - 355.0 / 33.0 * a2 + 46732.0 / 5247.0 * a3 + 49.0 / 176.0 * a4 - 5103.0 / 18656.0 * a5);
+            glm::dvec3 a6 = this->GeodesicAccel(x + h * (9017.0 / 3168.0 * v - 355.0 / 33.0 * v2 + 46732.0 / 5247.0 * v3 + 49.0 / 176.0 * v4 - 5103.0 / 18656.0 * v5), h2);
+            // 5th order solution, its derivative is the first stage of the next step (FSAL)
+            glm::dvec3 xn = x + h * (35.0 / 384.0 * v + 500.0 / 1113.0 * v3 + 125.0 / 192.0 * v4 - 2187.0 / 6784.0 * v5 + 11.0 / 84.0 * v6);
+            glm::dvec3 vn = v + h * (35.0 / 384.0 * a1 + 500.0 / 1113.0 * a3 + 125.0 / 192.0 * a4 - 2187.0 / 6784.0 * a5 + 11.0 / 84.0 * a6);
+            glm::dvec3 a7 = this->GeodesicAccel(xn, h2);
+
+            if (adaptive) {
+                // Difference to the embedded 4th order solution, position relative to r
+                glm::dvec3 ex = h * (71.0 / 57600.0 * v - 71.0 / 16695.0 * v3 + 71.0 / 1920.0 * v4 - 17253.0 / 339200.0 * v5 + 22.0 / 525.0 * v6 - 1.0 / 40.0 * vn);
+                glm::dvec3 ev = h * (71.0 / 57600.0 * a1 - 71.0 / 16695.0 * a3 + 71.0 / 1920.0 * a4 - 17253.0 / 339200.0 * a5 + 22.0 / 525.0 * a6 - 1.0 / 40.0 * a7);
+                double err = glm::max(glm::length(ex) / (1.0 + r), glm::length(ev)) / this->March.Tolerance;
+                double scale = 0.9 * pow(glm::max(err, 1e-10), -0.2);
+                if (err > 1.0) {
+                    h *= glm::max(scale, 0.2);
+                    continue;
+                }
+                h *= glm::min(scale, 5.0);
+            }
+            x = xn;
+            v = vn;
+            a1 = a7;
+        }
+        result.direction = v;
+        return result;
+    }
+
+    // Fills table with rows of size texels for observer radii log-spaced from minRadius to
+    // maxRadius (one row if they are equal). Every texel traces one ray with RayMarchRK45, so
+    // with this->March: use a tight Tolerance. The deflection is unwrapped from the nearly
+    // straight rays inward so that neighbouring texels never differ by 2 PI, and captured
+    // texels repeat the last escaped deflection to keep the filtering smooth.
+    // With a pool the rays are traced on the workers, 64 texels per task.
+    void BuildDeflectionTable(DeflectionTable& table, int size, int rows, double minRadius, double maxRadius, ThreadPool* pool = nullptr) const
+    {
+        table.Size = size;
+        table.Rows = rows;
+        table.MinRadius = minRadius;
+        table.MaxRadius = maxRadius;
+        table.Texels.assign(2 * size * rows, 0.0f);
+
+        // Observers sit on the +Z axis of the hole and look down -Z
+        glm::dvec3 e1 = glm::dvec3(0, 0, -1);
+        glm::dvec3 e2 = glm::dvec3(1, 0, 0);
+        // Deflection in (-PI, PI] of every texel, NaN if the ray is captured
+        vector<double> deflections(size * rows);
+        int chunksPerRow = (size + 63) / 64;
+        auto trace = [&](int chunk) {
+            int row = chunk / chunksPerRow;
+            int first = (chunk % chunksPerRow) * 64;
+            for (int i = first; i < glm::min(first + 64, size); i++)
+            {
+                double psi = DeflectionTable::Angle((i + 0.5) / size);
+                Ray ray;
+                ray.origin = this->Hole.center - table.Radius(row) * e1;
+                ray.direction = cos(psi) * e1 + sin(psi) * e2;
+                TraceResult result = this->RayMarchRK45(ray);
+                deflections[row * size + i] = result.escaped ? atan2(glm::dot(result.direction, e2), glm::dot(result.direction, e1)) - psi : NAN;
+            }
+        };
+        if (pool)
+            pool->ParallelFor(chunksPerRow * rows, trace);
+        else
+            for (int chunk = 0; chunk < chunksPerRow * rows; chunk++)
+                trace(chunk);
+
+        for (int row = 0; row < rows; row++)
+        {
+            double last = 0.0;
+            for (int i = size - 1; i >= 0; i--)
+            {
+                int texel = row * size + i;
+                bool escaped = !std::isnan(deflections[texel]);
+                if (escaped)
+                    last = deflections[texel] - 2.0 * 3.14159265358979323846 * floor((deflections[texel] - last) / (2.0 * 3.14159265358979323846) + 0.5);
+                table.Texels[2 * texel] = (float)last;
+                table.Texels[2 * texel + 1] = escaped ? 0.0f : 1.0f;
+            }
+        }
+    }
+
+    // Replaces the integration by one table fetch: the ray turns by the tabulated deflection in
+    // the plane through it and the hole. The eye has to be within the table's radii.
+    TraceResult RayLookup(const Ray& ray) const
+    {
+        TraceResult result;
+        result.steps = 0;
+
+        glm::dvec3 e1 = glm::normalize(this->Hole.center - ray.origin);
+        glm::dvec3 d = glm::normalize(ray.direction);
+        double c = glm::dot(d, e1);
+        glm::dvec3 perp = d - c * e1;
+        double s = glm::length(perp);
+        double psi = atan2(s, c);
+        glm::dvec2 entry = this->Table->Lookup(psi, glm::length(this->Hole.center - ray.origin));
+
+        glm::dvec3 e2 = s > 0.0 ? perp / s : glm::dvec3(0.0);
+        double phi = psi + entry.x;
+        result.escaped = entry.y < 0.5;
+        result.direction = cos(phi) * e1 + sin(phi) * e2;
+        return result;
+    }
+
+    // Skybox color seen along a view space direction
+    glm::dvec3 SkyColor(glm::dvec3 direction) const
+    {
+        glm::dvec3 worldDir = this->InverseView * direction;
+        glm::dvec3 normalizeDir = glm::normalize(worldDir);
+        normalizeDir = rotateVec3(normalizeDir, glm::dvec3(0, 1, 0), this->Time);
+        return this->Skybox->Sample(normalizeDir);
+    }
+
+    glm::dvec3 Shade(const TraceResult& result) const
+    {
+        return result.escaped ? this->SkyColor(result.direction) : glm::dvec3(0.0);
+    }
+
+    // ShadeGeometry in blackhole.frag: only the skybox rotation depends on Time
+    glm::dvec3 ShadeGeometry(const glm::dvec4& geometry) const
+    {
+        if (geometry.w < 0.5)
+            return glm::dvec3(0.0);
+        return this->Skybox->Sample(rotateVec3(glm::dvec3(geometry), glm::dvec3(0, 1, 0), this->Time));
+    }
+
+    // (u, v) is screenCoord from blackhole.vs, (0, 0) is the bottom left corner
+    glm::dvec3 RenderPixel(double u, double v) const
+    {
+        return this->Shade(this->Trace(this->CreateRay(u, v)));
+    }
+
+    // Follows the ray with the selected integrator
+    TraceResult Trace(const Ray& ray) const
+    {
+        if (this->Method == SPHERE_TRACE)
+            return this->RayMarch(ray);
+        if (this->Method == LOOKUP_TABLE)
+            return this->RayLookup(ray);
+        return this->RayMarchRK45(ray, this->Method == DORMAND_PRINCE);
+    }
+
+    void ResetStats() const
+    {
+        this->StepCount = 0;
+        this->RayCount = 0;
+    }
+
+    // Renders the pixels [x0, x1) x [y0, y1) of the image, sampling pixel centers like the rasterizer does
+    void RenderTile(Image& image, int x0, int y0, int x1, int y1) const
+    {
+        long long steps = 0;
+        for (int y = y0; y < y1; y++) {
+            double v = 1.0 - (y + 0.5) / image.Height;
+            for (int x = x0; x < x1; x++) {
+                double u = (x + 0.5) / image.Width;
+                TraceResult result = this->Trace(this->CreateRay(u, v));
+                steps += result.steps;
+                image.SetPixel(x, y, this->Shade(result));
+            }
+        }
+        this->StepCount += steps;
+        this->RayCount += (long long)(x1 - x0) * (y1 - y0);
+    }
+
+    // Same as RenderTile, but marches PACKET_SIZE neighbouring pixels of a row together.
+    // A short packet at the end of a row repeats its last pixel in the unused lanes.
+    // Only the SPHERE_TRACE loop has a packet version, and it does not count steps.
+    void RenderTilePacket(Image& image, int x0, int y0, int x1, int y1) const
+    {
+        const float center[3] = { (float)this->Hole.center.x, (float)this->Hole.center.y, (float)this->Hole.center.z };
+        // SkyColor() with the inverse view and the skybox rotation folded into one matrix
+        const glm::dmat3 sky = SkyRotation(this->Time) * this->InverseView;
+        RayPacket packet;
+        Ray rays[PACKET_SIZE];
+        for (int y = y0; y < y1; y++) {
+            double v = 1.0 - (y + 0.5) / image.Height;
+            for (int xp = x0; xp < x1; xp += PACKET_SIZE) {
+                for (int i = 0; i < PACKET_SIZE; i++) {
+                    int x = glm::min(xp + i, x1 - 1);
+                    rays[i] = this->CreateRay((x + 0.5) / image.Width, v);
+                    packet.ox[i] = (float)rays[i].origin.x;
+                    packet.oy[i] = (float)rays[i].origin.y;
+                    packet.oz[i] = (float)rays[i].origin.z;
+                    packet.dx[i] = (float)rays[i].direction.x;
+                    packet.dy[i] = (float)rays[i].direction.y;
+                    packet.dz[i] = (float)rays[i].direction.z;
+                }
+                RayMarchPacket(packet, center, (float)this->Hole.radius, this->March.MaxSteps, (float)this->March.MaxDist, (float)this->March.SurfDist);
+                for (int i = 0; i < PACKET_SIZE && xp + i < x1; i++) {
+                    glm::dvec3 color = glm::dvec3(0.0);
+                    if ((packet.escaped >> i) & 1)
+                        color = this->Skybox->Sample(sky * rays[i].direction);
+                    image.SetPixel(xp + i, y, color);
+                }
+            }
+        }
+    }
+
+    // Renders the whole image. With a pool the image is cut into TileSize x TileSize tiles
+    // that the workers share out between them, otherwise it is rendered on the calling thread.
+    void Render(Image& image, ThreadPool* pool = nullptr) const
+    {
+        if (this->CoarseTile > 0) {
+            GeometryBuffer geometry(image.Width, image.Height);
+            this->TraceGeometry(geometry, pool);
+            this->ShadeGeometry(geometry, image, pool);
+            return;
+        }
+
+        this->forEachTile(image.Width, image.Height, pool, [&](int x0, int y0, int x1, int y1) {
+            this->renderTile(image, x0, y0, x1, y1);
+        });
+    }
+
+    // Geometry pass: traces every pixel of the buffer once. As long as the camera does not move
+    // the buffer can be shaded for any Time with ShadeGeometry().
+    // With CoarseTile set, every CoarseTile x CoarseTile block first traces its four corner
+    // pixels and its center. If all five are captured the block is inside the shadow (which is
+    // convex on screen) and is filled as captured. If all escape and the center direction is
+    // within CoarseTolerance of the one interpolated from the corners, the whole block is
+    // interpolated. Only the remaining blocks, along the shadow edge and the photon ring, are
+    // traced per pixel. RayCount counts the rays actually traced.
+    void TraceGeometry(GeometryBuffer& buffer, ThreadPool* pool = nullptr) const
+    {
+        this->forEachTile(buffer.Width, buffer.Height, pool, [&](int x0, int y0, int x1, int y1) {
+            long long steps = 0, rays = 0;
+            int block = this->CoarseTile > 0 ? this->CoarseTile : glm::max(x1 - x0, y1 - y0);
+            for (int by = y0; by < y1; by += block)
+                for (int bx = x0; bx < x1; bx += block)
+                    this->traceBlock(buffer, bx, by, glm::min(bx + block, x1), glm::min(by + block, y1), steps, rays);
+            this->StepCount += steps;
+            this->RayCount += rays;
+        });
+    }
+
+    // Shading pass: one skybox fetch per pixel, at the current Time
+    void ShadeGeometry(const GeometryBuffer& buffer, Image& image, ThreadPool* pool = nullptr) const
+    {
+        this->forEachTile(image.Width, image.Height, pool, [&](int x0, int y0, int x1, int y1) {
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    image.SetPixel(x, y, this->ShadeGeometry(buffer.Texels[y * buffer.Width + x]));
+        });
+    }
+
+private:
+    // Calls f(x0, y0, x1, y1) for every TileSize x TileSize tile of a width x height image,
+    // on the pool's workers if there is one
+    template <typename F>
+    void forEachTile(int width, int height, ThreadPool* pool, F f) const
+    {
+        if (!pool) {
+            f(0, 0, width, height);
+            return;
+        }
+
+        int tilesX = (width + this->TileSize - 1) / this->TileSize;
+        int tilesY = (height + this->TileSize - 1) / this->TileSize;
+        pool->ParallelFor(tilesX * tilesY, [&](int tile) {
+            int x0 = (tile % tilesX) * this->TileSize;
+            int y0 = (tile / tilesX) * this->TileSize;
+            f(x0, y0, glm::min(x0 + this->TileSize, width), glm::min(y0 + this->TileSize, height));
+        });
+    }
+
+    // Traces the pixel into the buffer and returns its texel
+    glm::dvec4 tracePixel(GeometryBuffer& buffer, int x, int y, long long& steps, long long& rays) const
+    {
+        TraceResult result = this->Trace(this->CreateRay((x + 0.5) / buffer.Width, 1.0 - (y + 0.5) / buffer.Height));
+        steps += result.steps;
+        rays++;
+        glm::dvec4 geometry = glm::dvec4(0.0);
+        if (result.escaped)
+            geometry = glm::dvec4(glm::normalize(this->InverseView * result.direction), 1.0);
+        buffer.Texels[y * buffer.Width + x] = geometry;
+        return geometry;
+    }
+
+    // Fills the pixels [x0, x1) x [y0, y1) of the buffer, see TraceGeometry()
+    void traceBlock(GeometryBuffer& buffer, int x0, int y0, int x1, int y1, long long& steps, long long& rays) const
+    {
+        int cx = (x0 + x1) / 2, cy = (y0 + y1) / 2;
+        bool coarse = this->CoarseTile > 0 && x1 - x0 > 2 && y1 - y0 > 2;
+        if (coarse) {
+            glm::dvec4 c00 = this->tracePixel(buffer, x0, y0, steps, rays);
+            glm::dvec4 c10 = this->tracePixel(buffer, x1 - 1, y0, steps, rays);
+            glm::dvec4 c01 = this->tracePixel(buffer, x0, y1 - 1, steps, rays);
+            glm::dvec4 c11 = this->tracePixel(buffer, x1 - 1, y1 - 1, steps, rays);
+            glm::dvec4 center = this->tracePixel(buffer, cx, cy, steps, rays);
+            double escaped = c00.w + c10.w + c01.w + c11.w + center.w;
+            // Direction at (x, y) interpolated from the corners
+            auto interpolate = [&](int x, int y) {
+                double fx = (double)(x - x0) / (x1 - 1 - x0);
+                double fy = (double)(y - y0) / (y1 - 1 - y0);
+                glm::dvec3 d = glm::mix(glm::mix(glm::dvec3(c00), glm::dvec3(c10), fx), glm::mix(glm::dvec3(c01), glm::dvec3(c11), fx), fy);
+                return glm::dvec4(glm::normalize(d), 1.0);
+            };
+            if (escaped == 0.0 || (escaped == 5.0 && acos(glm::min(glm::dot(glm::dvec3(interpolate(cx, cy)), glm::dvec3(center)), 1.0)) <= this->CoarseTolerance)) {
+                for (int y = y0; y < y1; y++)
+                    for (int x = x0; x < x1; x++)
+                        buffer.Texels[y * buffer.Width + x] = escaped == 0.0 ? glm::dvec4(0.0) : interpolate(x, y);
+                return;
+            }
+        }
+
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++) {
+                // The corners and the center are already traced
+                if (coarse && (((x == x0 || x == x1 - 1) && (y == y0 || y == y1 - 1)) || (x == cx && y == cy)))
+                    continue;
+                this->tracePixel(buffer, x, y, steps, rays);
+            }
+    }
+
+    void renderTile(Image& image, int x0, int y0, int x1, int y1) const
+    {
+        if (this->UsePackets && this->Method == SPHERE_TRACE)
+            this->RenderTilePacket(image, x0, y0, x1, y1);
+        else
+            this->RenderTile(image, x0, y0, x1, y1);
+    }
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// GLM
+#include <glm/glm.hpp>
+
+#include <SOIL/SOIL.h>
+#include <SOIL/image_helper.h>
+extern "C" {
+#include <SOIL/image_DXT.h>
+}
+
+// Other includes
+#include "ThreadPool.h"
+
+using namespace std;
+
+// A CPU copy of the skybox cubemap. Sampling follows the OpenGL cubemap face selection
+// and GL_LINEAR / GL_CLAMP_TO_EDGE filtering that loadCubemap() sets up on the GPU,
+// so texture(skybox, dir) in blackhole.frag and Sample(dir) return the same texel blend.
+class Cubemap
+{
+public:
+    // Face size and decoded RGB texels, one image per face in loadCubemap() order
+    int Width;
+    int Height;
+    vector<unsigned char*> Faces;
+
+    Cubemap() : Width(0), Height(0)
+    {
+    }
+    Cubemap(const Cubemap&) = delete;
+    Cubemap& operator=(const Cubemap&) = delete;
+
+    ~Cubemap()
+    {
+        for (size_t i = 0; i < this->Faces.size(); i++)
+            SOIL_free_image_data(this->Faces[i]);
+    }
+
+    // Loads the six faces, order should be +X, -X, +Y, -Y, +Z, -Z (same as loadCubemap).
+    // With a pool the faces are decoded in parallel.
+    bool Load(const vector<string>& faces, ThreadPool* pool = nullptr)
+    {
+        vector<int> width(faces.size()), height(faces.size());
+        vector<unsigned char*> images(faces.size());
+        auto decode = [&](int i) {
+            images[i] = SOIL_load_image(faces[i].c_str(), &width[i], &height[i], 0, SOIL_LOAD_RGB);
+        };
+        if (pool)
+            pool->ParallelFor((int)faces.size(), decode);
+        else {
+            for (size_t i = 0; i < faces.size(); i++)
+                decode((int)i);
+        }
+
+        bool loaded = true;
+        for (size_t i = 0; i < faces.size(); i++)
+        {
+            if (loaded && (!images[i] || width[i] != width[0] || height[i] != height[0]))
+            {
+                cout << "ERROR::CUBEMAP::FACE_NOT_LOADED " << faces[i] << endl;
+                loaded = false;
+            }
+            if (!loaded) {
+                SOIL_free_image_data(images[i]);
+                continue;
+            }
+            this->Width = width[i];
+            this->Height = height[i];
+            this->Faces.push_back(images[i]);
+        }
+        return loaded && this->Faces.size() == 6;
+    }
+
+    // Writes the faces as a DXT1 compressed cubemap DDS with a full mip chain of 2x2 box
+    // filtered levels, the faces in loadCubemap() order. blackhole.cpp uploads it as is, which
+    // takes an eighth of the video memory of the RGB faces and skips the PNG decode. With a
+    // pool the levels are cut into strips of block rows that are compressed in parallel, so
+    // all workers stay busy even though there are only six faces and one big level each.
+    bool SaveDDS(const string& path, ThreadPool* pool = nullptr) const
+    {
+        if (this->Faces.size() != 6)
+            return false;
+        int levels = 1;
+        for (int size = glm::max(this->Width, this->Height); size > 1; size >>= 1)
+            levels++;
+        vector<int> widths(levels), heights(levels);
+        widths[0] = this->Width;
+        heights[0] = this->Height;
+        for (int i = 1; i < levels; i++) {
+            widths[i] = glm::max(widths[i - 1] / 2, 1);
+            heights[i] = glm::max(heights[i - 1] / 2, 1);
+        }
+
+        // Mip chains first, level i of a face is images[face * levels + i]
+        vector<vector<unsigned char>> images(6 * levels);
+        auto downsample = [&](int face) {
+            images[face * levels].assign(this->Faces[face], this->Faces[face] + this->Width * this->Height * 3);
+            for (int i = 1; i < levels; i++) {
+                images[face * levels + i].resize(widths[i] * heights[i] * 3);
+                mipmap_image(&images[face * levels + i - 1][0], widths[i - 1], heights[i - 1], 3,
+                    &images[face * levels + i][0], 2, 2);
+            }
+        };
+
+        // Then the strips, in file order. A block row only depends on its own four pixel rows,
+        // so compressing the strips separately and joining them gives the same blocks.
+        const int stripRows = 64;
+        struct Strip {
+            int Image;
+            int Row;
+            int Rows;
+        };
+        vector<Strip> strips;
+        for (int face = 0; face < 6; face++) {
+            for (int i = 0; i < levels; i++) {
+                for (int row = 0; row < heights[i]; row += stripRows) {
+                    Strip strip = { face * levels + i, row, glm::min(stripRows, heights[i] - row) };
+                    strips.push_back(strip);
+                }
+            }
+        }
+        vector<vector<unsigned char>> blocks(strips.size());
+        auto compress = [&](int index) {
+            const Strip& strip = strips[index];
+            int width = widths[strip.Image % levels];
+            int size;
+            unsigned char* dxt = convert_image_to_DXT1(&images[strip.Image][strip.Row * width * 3], width, strip.Rows, 3, &size);
+            blocks[index].assign(dxt, dxt + size);
+            free(dxt);
+        };
+        if (pool) {
+            pool->ParallelFor(6, downsample);
+            pool->ParallelFor((int)strips.size(), compress);
+        }
+        else {
+            for (int face = 0; face < 6; face++)
+                downsample(face);
+            for (int i = 0; i < (int)strips.size(); i++)
+                compress(i);
+        }
+
+        DDS_header header;
+        memset(&header, 0, sizeof(header));
+        header.dwMagic = ('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24);
+        header.dwSize = 124;
+        header.dwFlags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_LINEARSIZE | DDSD_MIPMAPCOUNT;
+        header.dwWidth = this->Width;
+        header.dwHeight = this->Height;
+        header.dwPitchOrLinearSize = ((this->Width + 3) / 4) * ((this->Height + 3) / 4) * 8;
+        header.dwMipMapCount = levels;
+        header.sPixelFormat.dwSize = 32;
+        header.sPixelFormat.dwFlags = DDPF_FOURCC;
+        header.sPixelFormat.dwFourCC = ('D' << 0) | ('X' << 8) | ('T' << 16) | ('1' << 24);
+        header.sCaps.dwCaps1 = DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+        header.sCaps.dwCaps2 = DDSCAPS2_CUBEMAP | DDSCAPS2_CUBEMAP_POSITIVEX | DDSCAPS2_CUBEMAP_NEGATIVEX
+            | DDSCAPS2_CUBEMAP_POSITIVEY | DDSCAPS2_CUBEMAP_NEGATIVEY | DDSCAPS2_CUBEMAP_POSITIVEZ | DDSCAPS2_CUBEMAP_NEGATIVEZ;
+
+        ofstream file(path.c_str(), ios::binary);
+        file.write((const char*)&header, sizeof(header));
+        for (size_t i = 0; i < blocks.size(); i++)
+            file.write((const char*)&blocks[i][0], blocks[i].size());
+        if (!file) {
+            cout << "ERROR::CUBEMAP::FILE_NOT_WRITTEN " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Returns the filtered color in [0, 1] seen along direction dir (need not be normalized)
+    glm::dvec3 Sample(glm::dvec3 dir) const
+    {
+        glm::dvec3 a = glm::abs(dir);
+        int face;
+        double sc, tc, ma;
+        if (a.x >= a.y && a.x >= a.z) {
+            face = dir.x > 0.0 ? 0 : 1;
+            sc = dir.x > 0.0 ? -dir.z : dir.z;
+            tc = -dir.y;
+            ma = a.x;
+        }
+        else if (a.y >= a.z) {
+            face = dir.y > 0.0 ? 2 : 3;
+            sc = dir.x;
+            tc = dir.y > 0.0 ? dir.z : -dir.z;
+            ma = a.y;
+        }
+        else {
+            face = dir.z > 0.0 ? 4 : 5;
+            sc = dir.z > 0.0 ? dir.x : -dir.x;
+            tc = -dir.y;
+            ma = a.z;
+        }
+        if (ma <= 0.0)
+            return glm::dvec3(0.0);
+
+        double s = 0.5 * (sc / ma + 1.0);
+        double t = 0.5 * (tc / ma + 1.0);
+        return this->bilinear(face, s, t);
+    }
+
+private:
+    glm::dvec3 texel(int face, int x, int y) const
+    {
+        x = glm::clamp(x, 0, this->Width - 1);
+        y = glm::clamp(y, 0, this->Height - 1);
+        const unsigned char* p = this->Faces[face] + 3 * (y * this->Width + x);
+        return glm::dvec3(p[0], p[1], p[2]) / 255.0;
+    }
+
+    glm::dvec3 bilinear(int face, double s, double t) const
+    {
+        double x = s * this->Width - 0.5;
+        double y = t * this->Height - 0.5;
+        double x0 = floor(x), y0 = floor(y);
+        double fx = x - x0, fy = y - y0;
+        int ix = (int)x0, iy = (int)y0;
+
+        glm::dvec3 c00 = this->texel(face, ix, iy);
+        glm::dvec3 c10 = this->texel(face, ix + 1, iy);
+        glm::dvec3 c01 = this->texel(face, ix, iy + 1);
+        glm::dvec3 c11 = this->texel(face, ix + 1, iy + 1);
+        return glm::mix(glm::mix(c00, c10, fx), glm::mix(c01, c11, fx), fy);
+    }
+};
@@ -0,0 +1,269 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <future>
+
+// GLEW
+#include <GL/glew.h>
+
+#include <SOIL/SOIL.h>
+#include <SOIL/image_helper.h>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+// Number of mip levels of a width x height texture, down to 1x1
+inline int MipLevels(int width, int height)
+{
+    int levels = 1;
+    for (int size = width > height ? width : height; size > 1; size >>= 1)
+        levels++;
+    return levels;
+}
+
+// The levels below a width x height RGB image one after the other, each a 2x2 box filter of
+// the one above. Same result as glGenerateMipmap, but it can run on the thread that decoded
+// the image instead of stalling the GL thread.
+inline vector<unsigned char> MipChain(const unsigned char* image, int width, int height)
+{
+    vector<unsigned char> chain;
+    size_t above = 0;
+    int levels = MipLevels(width, height);
+    for (int level = 1; level < levels; level++) {
+        int mipWidth = width > 1 ? width / 2 : 1, mipHeight = height > 1 ? height / 2 : 1;
+        size_t offset = chain.size();
+        chain.resize(offset + (size_t)mipWidth * mipHeight * 3);
+        mipmap_image(level == 1 ? image : &chain[above], width, height, 3, &chain[offset], 2, 2);
+        above = offset;
+        width = mipWidth;
+        height = mipHeight;
+    }
+    return chain;
+}
+
+// Uploads an RGB image and the MipChain() below it into a cube face of the bound texture.
+// Pass null pointers to read them from the bound pixel unpack buffer, the image at offset 0
+// and the chain right after it.
+inline void UploadMipChain(GLenum target, int width, int height, const unsigned char* image, const unsigned char* chain)
+{
+    // Rows of the small levels are not 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(target, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+    const unsigned char* level = chain ? chain : image + (size_t)width * height * 3;
+    int levels = MipLevels(width, height);
+    for (int i = 1; i < levels; i++) {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        glTexImage2D(target, i, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, level);
+        level += (size_t)width * height * 3;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+// Loads a cubemap in the background while the renderer keeps drawing with a placeholder.
+// Every face is decoded and mipmapped by a job on the thread pool. The GL thread then maps a
+// pixel unpack buffer for it, a second job copies the levels into the mapping, and the GL
+// thread unmaps it and starts the upload from the buffer, so neither the decode nor the copy
+// stalls a frame. The texture is only handed out once all six faces are in, so it can be
+// swapped in at once.
+class CubemapStream
+{
+public:
+    // Starts decoding the faces, order should be +X, -X, +Y, -Y, +Z, -Z (same as loadCubemap).
+    // Needs the GL context current, as do Update() and the destructor. The pool has to outlive
+    // the stream.
+    CubemapStream(const vector<string>& faces, ThreadPool& pool) : pool(pool), texture(0), uploaded(0), failed(false), cancelled(false)
+    {
+        glGenTextures(1, &this->texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, this->texture);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+        this->faces.resize(faces.size());
+        for (size_t i = 0; i < faces.size(); i++) {
+            this->faces[i].Path = faces[i];
+            int index = (int)i;
+            this->jobs.push_back(this->pool.Submit([this, index] { this->decode(index); }));
+        }
+    }
+
+    ~CubemapStream()
+    {
+        {
+            lock_guard<mutex> lock(this->lock);
+            this->cancelled = true;
+        }
+        // Jobs that have not started return at once
+        for (size_t i = 0; i < this->jobs.size(); i++)
+            this->jobs[i].wait();
+        for (size_t i = 0; i < this->faces.size(); i++) {
+            Face& face = this->faces[i];
+            if (face.Buffer) {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, face.Buffer);
+                if (face.Mapping && (face.State == MAPPED || face.State == COPIED))
+                    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                glDeleteBuffers(1, &face.Buffer);
+            }
+            SOIL_free_image_data(face.Image);
+        }
+        glDeleteTextures(1, &this->texture);
+    }
+
+    CubemapStream(const CubemapStream&) = delete;
+    CubemapStream& operator=(const CubemapStream&) = delete;
+
+    // Moves the faces along, call once per frame. Returns the finished texture once all six
+    // faces are uploaded (the caller owns it from then on), 0 until then and after a failure.
+    GLuint Update()
+    {
+        if (this->failed || this->texture == 0)
+            return 0;
+
+        unique_lock<mutex> lock(this->lock);
+        for (size_t i = 0; i < this->faces.size(); i++) {
+            Face& face = this->faces[i];
+            if (face.State == FAILED) {
+                if (!this->failed)
+                    cout << "ERROR::CUBEMAP::FACE_NOT_LOADED " << face.Path << endl;
+                this->failed = true;
+            }
+            else if (face.State == DECODED) {
+                // Orphaned buffer, a job fills the mapping
+                GLsizeiptr size = (GLsizeiptr)face.Width * face.Height * 3 + face.Mips.size();
+                glGenBuffers(1, &face.Buffer);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, face.Buffer);
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+                face.Mapping = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                if (!face.Mapping) {
+                    face.State = FAILED;
+                    continue;
+                }
+                face.State = MAPPED;
+                int index = (int)i;
+                this->jobs.push_back(this->pool.Submit([this, index] { this->copy(index); }));
+            }
+            else if (face.State == COPIED) {
+                // The driver copies from the buffer on its own time, deleting it only drops our name
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, face.Buffer);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                glBindTexture(GL_TEXTURE_CUBE_MAP, this->texture);
+                UploadMipChain(GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)i, face.Width, face.Height, 0, 0);
+                glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                glDeleteBuffers(1, &face.Buffer);
+                face.Buffer = 0;
+                face.Mapping = nullptr;
+                face.State = UPLOADED;
+                this->uploaded++;
+            }
+        }
+        if (this->failed || this->uploaded < (int)this->faces.size())
+            return 0;
+        for (size_t i = 1; i < this->faces.size(); i++) {
+            if (this->faces[i].Width != this->faces[0].Width || this->faces[i].Height != this->faces[0].Height) {
+                cout << "ERROR::CUBEMAP::FACE_NOT_LOADED " << this->faces[i].Path << endl;
+                this->failed = true;
+                return 0;
+            }
+        }
+
+        GLuint finished = this->texture;
+        this->texture = 0;
+        return finished;
+    }
+
+    bool Failed() const
+    {
+        return this->failed;
+    }
+
+private:
+    enum FaceState { DECODING, FAILED, DECODED, MAPPED, COPIED, UPLOADED };
+
+    struct Face {
+        string Path;
+        FaceState State;
+        int Width;
+        int Height;
+        unsigned char* Image;
+        vector<unsigned char> Mips;
+        GLuint Buffer;
+        void* Mapping;
+
+        Face() : State(DECODING), Width(0), Height(0), Image(nullptr), Buffer(0), Mapping(nullptr)
+        {
+        }
+    };
+
+    ThreadPool& pool;
+    GLuint texture;
+    vector<Face> faces;
+    // Every job submitted so far, the destructor waits for them
+    vector<future<void>> jobs;
+    int uploaded;
+    bool failed;
+
+    mutex lock;
+    bool cancelled;
+
+    // Decodes and mipmaps one face
+    void decode(int index)
+    {
+        string path;
+        {
+            lock_guard<mutex> lock(this->lock);
+            if (this->cancelled)
+                return;
+            path = this->faces[index].Path;
+        }
+        int width, height;
+        unsigned char* image = SOIL_load_image(path.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
+        vector<unsigned char> mips;
+        if (image)
+            mips = MipChain(image, width, height);
+
+        lock_guard<mutex> lock(this->lock);
+        Face& face = this->faces[index];
+        if (!image) {
+            face.State = FAILED;
+            return;
+        }
+        face.Width = width;
+        face.Height = height;
+        face.Image = image;
+        face.Mips.swap(mips);
+        face.State = DECODED;
+    }
+
+    // Copies the levels of a MAPPED face into its mapping, which stays valid until the GL
+    // thread unmaps it, and it only does so once the face is COPIED
+    void copy(int index)
+    {
+        unique_lock<mutex> lock(this->lock);
+        if (this->cancelled)
+            return;
+        Face& face = this->faces[index];
+        lock.unlock();
+        size_t size = (size_t)face.Width * face.Height * 3;
+        memcpy(face.Mapping, face.Image, size);
+        if (!face.Mips.empty())
+            memcpy((unsigned char*)face.Mapping + size, &face.Mips[0], face.Mips.size());
+        SOIL_free_image_data(face.Image);
+        lock.lock();
+        face.Image = nullptr;
+        vector<unsigned char>().swap(face.Mips);
+        face.State = COPIED;
+    }
+};
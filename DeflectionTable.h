@@ -0,0 +1,139 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// GLM
+#include <glm/glm.hpp>
+
+using namespace std;
+
+// Where a Schwarzschild photon ends up only depends on its impact parameter and on the radius
+// it starts from. For an observer at a given distance from the hole both follow from the angle
+// psi between the ray and the direction to the hole, so one table row indexed by psi replaces
+// the whole geodesic integration: texel i holds the angle the ray turns by in its plane (R) and
+// whether it falls into the hole (G, 1 = captured).
+//
+// The texture coordinate is t = sqrt(psi / PI), which spends most texels on the small angles
+// around the shadow where the deflection changes quickly. Texel i is sampled at its center
+// t = (i + 0.5) / Size, exactly like a GL_LINEAR texture.
+//
+// A table has one row per observer radius, log-spaced from MinRadius to MaxRadius, so that
+// a GL_LINEAR 2D texture blends the two rows nearest to the camera's distance.
+struct DeflectionTable {
+    int Size;
+    int Rows;
+    double MinRadius;
+    double MaxRadius;
+    // Rows * Size RG pairs, row after row: deflection in radians, capture mask
+    vector<float> Texels;
+
+    DeflectionTable() : Size(0), Rows(0), MinRadius(0.0), MaxRadius(0.0)
+    {
+    }
+
+    // Angle to the hole of the ray stored at texture coordinate t, and back
+    static double Angle(double t)
+    {
+        return 3.14159265358979323846 * t * t;
+    }
+
+    static double TexCoord(double psi)
+    {
+        return sqrt(psi / 3.14159265358979323846);
+    }
+
+    // Observer radius of a row
+    double Radius(int row) const
+    {
+        if (this->Rows < 2)
+            return this->MinRadius;
+        return this->MinRadius * pow(this->MaxRadius / this->MinRadius, (double)row / (this->Rows - 1));
+    }
+
+    bool Covers(double radius) const
+    {
+        return this->Rows > 0 && radius >= this->MinRadius && radius <= this->MaxRadius;
+    }
+
+    // Texture coordinate across the rows of an observer radius inside [MinRadius, MaxRadius]
+    double RowCoord(double radius) const
+    {
+        if (this->Rows < 2)
+            return 0.5;
+        double row = log(radius / this->MinRadius) / log(this->MaxRadius / this->MinRadius) * (this->Rows - 1);
+        return (row + 0.5) / this->Rows;
+    }
+
+    // Same result as texture(deflectionTable, vec2(TexCoord(psi), RowCoord(radius))).rg with
+    // GL_LINEAR and GL_CLAMP_TO_EDGE
+    glm::dvec2 Lookup(double psi, double radius) const
+    {
+        double x = TexCoord(psi) * this->Size - 0.5;
+        double y = RowCoord(radius) * this->Rows - 0.5;
+        double x0 = floor(x), y0 = floor(y);
+        double fx = x - x0, fy = y - y0;
+        glm::dvec2 a = glm::mix(this->texel((int)x0, (int)y0), this->texel((int)x0 + 1, (int)y0), fx);
+        glm::dvec2 b = glm::mix(this->texel((int)x0, (int)y0 + 1), this->texel((int)x0 + 1, (int)y0 + 1), fx);
+        return glm::mix(a, b, fy);
+    }
+
+    // Binary file: "BHDT", version, Size, Rows, MinRadius, MaxRadius, hole radius, then the texels
+    bool Save(const string& path, double holeRadius) const
+    {
+        ofstream file(path.c_str(), ios::binary);
+        int header[3] = { 1, this->Size, this->Rows };
+        double radii[3] = { this->MinRadius, this->MaxRadius, holeRadius };
+        file.write("BHDT", 4);
+        file.write((const char*)header, sizeof(header));
+        file.write((const char*)radii, sizeof(radii));
+        file.write((const char*)&this->Texels[0], this->Texels.size() * sizeof(float));
+        if (!file) {
+            cout << "ERROR::DEFLECTION_TABLE::FILE_NOT_WRITTEN " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Loads a file written by Save() for a hole of the given radius
+    bool Load(const string& path, double holeRadius)
+    {
+        ifstream file(path.c_str(), ios::binary);
+        char magic[4];
+        int header[3];
+        double radii[3];
+        file.read(magic, 4);
+        file.read((char*)header, sizeof(header));
+        file.read((char*)radii, sizeof(radii));
+        if (!file || memcmp(magic, "BHDT", 4) != 0 || header[0] != 1 || header[1] <= 0 || header[2] <= 0 || radii[2] != holeRadius) {
+            cout << "ERROR::DEFLECTION_TABLE::FILE_NOT_SUCCESFULLY_READ " << path << endl;
+            return false;
+        }
+        this->Size = header[1];
+        this->Rows = header[2];
+        this->MinRadius = radii[0];
+        this->MaxRadius = radii[1];
+        this->Texels.resize(2 * this->Size * this->Rows);
+        file.read((char*)&this->Texels[0], this->Texels.size() * sizeof(float));
+        if (!file) {
+            cout << "ERROR::DEFLECTION_TABLE::FILE_NOT_SUCCESFULLY_READ " << path << endl;
+            this->Rows = 0;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    glm::dvec2 texel(int x, int y) const
+    {
+        x = glm::clamp(x, 0, this->Size - 1);
+        y = glm::clamp(y, 0, this->Rows - 1);
+        const float* p = &this->Texels[2 * (y * this->Size + x)];
+        return glm::dvec2(p[0], p[1]);
+    }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+// Std. Includes
+#include <cmath>
+
+// GLEW
+#include <GL/glew.h>
+
+// Picks the resolution of a pass from its measured GPU time, so that the frame rate holds when
+// the pass gets expensive (the camera close to the hole) instead of collapsing. Begin() and
+// End() wrap the GPU work of one frame in a timer query, and Update() reads the queries that
+// are done without waiting for the others. The time is assumed to grow with the pixel count,
+// so the scale of each axis moves by the square root of the budget over the time.
+class DynamicResolution
+{
+public:
+    // budget in seconds, scales are per axis
+    DynamicResolution(double budget, float minScale = 0.25f, float maxScale = 1.0f)
+        : Budget(budget), MinScale(minScale), MaxScale(maxScale), scale(maxScale), next(0), timing(false)
+    {
+        glGenQueries(QueryCount, this->queries);
+        for (int i = 0; i < QueryCount; i++)
+            this->pending[i] = false;
+    }
+
+    ~DynamicResolution()
+    {
+        glDeleteQueries(QueryCount, this->queries);
+    }
+
+    DynamicResolution(const DynamicResolution&) = delete;
+    DynamicResolution& operator=(const DynamicResolution&) = delete;
+
+    double Budget;
+    float MinScale;
+    float MaxScale;
+
+    // Scale the next frame should be rendered at
+    float Scale() const
+    {
+        return this->scale;
+    }
+
+    // Size of an axis of full pixels at Scale(), at least 1
+    GLuint Size(GLuint full) const
+    {
+        GLuint size = (GLuint)(full * this->scale + 0.5f);
+        return size > 0 ? size : 1;
+    }
+
+    // Starts timing a frame rendered at Scale(). Frames are not timed while all queries are
+    // still in flight, Begin() and End() then do nothing.
+    void Begin()
+    {
+        this->timing = !this->pending[this->next];
+        if (!this->timing)
+            return;
+        glBeginQuery(GL_TIME_ELAPSED, this->queries[this->next]);
+        this->measuredScale[this->next] = this->scale;
+    }
+
+    void End()
+    {
+        if (!this->timing)
+            return;
+        glEndQuery(GL_TIME_ELAPSED);
+        this->pending[this->next] = true;
+        this->next = (this->next + 1) % QueryCount;
+        this->timing = false;
+    }
+
+    // Moves the scale towards the budget with every finished query. Returns true if it changed.
+    bool Update()
+    {
+        float previous = this->scale;
+        for (int i = 0; i < QueryCount; i++) {
+            int query = (this->next + i) % QueryCount;  // oldest first
+            if (!this->pending[query])
+                continue;
+            GLint available = 0;
+            glGetQueryObjectiv(this->queries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(this->queries[query], GL_QUERY_RESULT, &elapsed);
+            this->pending[query] = false;
+            if (elapsed == 0)
+                continue;
+
+            // Halfway to the scale that would have hit the budget, so one odd frame does not
+            // swing it, and in steps of 1/20 so small changes do not force a new pass
+            float target = this->measuredScale[query] * (float)sqrt(this->Budget / (elapsed * 1e-9));
+            float scale = 0.5f * (this->scale + target);
+            scale = floor(scale * 20.0f + 0.5f) / 20.0f;
+            this->scale = scale < this->MinScale ? this->MinScale : scale > this->MaxScale ? this->MaxScale : scale;
+        }
+        return this->scale != previous;
+    }
+
+private:
+    static const int QueryCount = 4;
+
+    float scale;
+    GLuint queries[QueryCount];
+    bool pending[QueryCount];
+    float measuredScale[QueryCount];
+    int next;
+    bool timing;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+// Std. Includes
+#include <cmath>
+
+#include <immintrin.h>
+
+// Structure-of-arrays ray packets for the CPU renderer. One packet holds a SIMD register's
+// worth of rays (16 with AVX-512, 8 with AVX/AVX2, 4 with the SSE2 baseline) and marches them
+// together; lanes that escaped or reached the surface are masked out instead of branched on.
+
+#if defined(__AVX512F__)
+#define PACKET_SIZE 16
+typedef __m512 PacketFloat;
+typedef __mmask16 PacketMask;
+inline PacketFloat packet_set1(float a) { return _mm512_set1_ps(a); }
+inline PacketFloat packet_load(const float* p) { return _mm512_load_ps(p); }
+inline void packet_store(float* p, PacketFloat a) { _mm512_store_ps(p, a); }
+inline PacketFloat packet_add(PacketFloat a, PacketFloat b) { return _mm512_add_ps(a, b); }
+inline PacketFloat packet_sub(PacketFloat a, PacketFloat b) { return _mm512_sub_ps(a, b); }
+inline PacketFloat packet_mul(PacketFloat a, PacketFloat b) { return _mm512_mul_ps(a, b); }
+inline PacketFloat packet_sqrt(PacketFloat a) { return _mm512_sqrt_ps(a); }
+inline PacketMask packet_gt(PacketFloat a, PacketFloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+inline PacketMask packet_lt(PacketFloat a, PacketFloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+inline PacketMask packet_all() { return (PacketMask)0xFFFF; }
+inline PacketMask packet_none() { return (PacketMask)0; }
+inline PacketMask packet_and(PacketMask a, PacketMask b) { return a & b; }
+inline PacketMask packet_andnot(PacketMask a, PacketMask b) { return (PacketMask)(~a & b); }
+inline PacketMask packet_or(PacketMask a, PacketMask b) { return a | b; }
+inline int packet_bits(PacketMask m) { return (int)m; }
+// Lanes where m is set take a, the others b
+inline PacketFloat packet_select(PacketMask m, PacketFloat a, PacketFloat b) { return _mm512_mask_blend_ps(m, b, a); }
+#elif defined(__AVX__)
+#define PACKET_SIZE 8
+typedef __m256 PacketFloat;
+typedef __m256 PacketMask;
+inline PacketFloat packet_set1(float a) { return _mm256_set1_ps(a); }
+inline PacketFloat packet_load(const float* p) { return _mm256_load_ps(p); }
+inline void packet_store(float* p, PacketFloat a) { _mm256_store_ps(p, a); }
+inline PacketFloat packet_add(PacketFloat a, PacketFloat b) { return _mm256_add_ps(a, b); }
+inline PacketFloat packet_sub(PacketFloat a, PacketFloat b) { return _mm256_sub_ps(a, b); }
+inline PacketFloat packet_mul(PacketFloat a, PacketFloat b) { return _mm256_mul_ps(a, b); }
+inline PacketFloat packet_sqrt(PacketFloat a) { return _mm256_sqrt_ps(a); }
+inline PacketMask packet_gt(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline PacketMask packet_lt(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline PacketMask packet_all() { return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+inline PacketMask packet_none() { return _mm256_setzero_ps(); }
+inline PacketMask packet_and(PacketMask a, PacketMask b) { return _mm256_and_ps(a, b); }
+inline PacketMask packet_andnot(PacketMask a, PacketMask b) { return _mm256_andnot_ps(a, b); }
+inline PacketMask packet_or(PacketMask a, PacketMask b) { return _mm256_or_ps(a, b); }
+inline int packet_bits(PacketMask m) { return _mm256_movemask_ps(m); }
+inline PacketFloat packet_select(PacketMask m, PacketFloat a, PacketFloat b) { return _mm256_blendv_ps(b, a, m); }
+#else
+#define PACKET_SIZE 4
+typedef __m128 PacketFloat;
+typedef __m128 PacketMask;
+inline PacketFloat packet_set1(float a) { return _mm_set1_ps(a); }
+inline PacketFloat packet_load(const float* p) { return _mm_load_ps(p); }
+inline void packet_store(float* p, PacketFloat a) { _mm_store_ps(p, a); }
+inline PacketFloat packet_add(PacketFloat a, PacketFloat b) { return _mm_add_ps(a, b); }
+inline PacketFloat packet_sub(PacketFloat a, PacketFloat b) { return _mm_sub_ps(a, b); }
+inline PacketFloat packet_mul(PacketFloat a, PacketFloat b) { return _mm_mul_ps(a, b); }
+inline PacketFloat packet_sqrt(PacketFloat a) { return _mm_sqrt_ps(a); }
+inline PacketMask packet_gt(PacketFloat a, PacketFloat b) { return _mm_cmpgt_ps(a, b); }
+inline PacketMask packet_lt(PacketFloat a, PacketFloat b) { return _mm_cmplt_ps(a, b); }
+inline PacketMask packet_all() { return _mm_castsi128_ps(_mm_set1_epi32(-1)); }
+inline PacketMask packet_none() { return _mm_setzero_ps(); }
+inline PacketMask packet_and(PacketMask a, PacketMask b) { return _mm_and_ps(a, b); }
+inline PacketMask packet_andnot(PacketMask a, PacketMask b) { return _mm_andnot_ps(a, b); }
+inline PacketMask packet_or(PacketMask a, PacketMask b) { return _mm_or_ps(a, b); }
+inline int packet_bits(PacketMask m) { return _mm_movemask_ps(m); }
+inline PacketFloat packet_select(PacketMask m, PacketFloat a, PacketFloat b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+#endif
+
+// PACKET_SIZE rays in structure-of-arrays layout, filled by the caller
+struct RayPacket {
+    alignas(64) float ox[PACKET_SIZE];
+    alignas(64) float oy[PACKET_SIZE];
+    alignas(64) float oz[PACKET_SIZE];
+    alignas(64) float dx[PACKET_SIZE];
+    alignas(64) float dy[PACKET_SIZE];
+    alignas(64) float dz[PACKET_SIZE];
+    // Bit i is set if ray i escaped past Max_Dist (written by RayMarchPacket)
+    int escaped;
+};
+
+// Sphere tracing loop of RayMarch() in blackhole.frag for a whole packet. Every lane runs the
+// same instructions; a lane stops advancing d0 once it escaped (d0 > Max_Dist) or reached the
+// surface (d0 < Surf_Dist), and the loop ends when no lane is left or Max_Steps is reached.
+inline void RayMarchPacket(RayPacket& packet, const float center[3], float radius, int maxSteps, float maxDist, float surfDist)
+{
+    const PacketFloat ox = packet_load(packet.ox), oy = packet_load(packet.oy), oz = packet_load(packet.oz);
+    const PacketFloat dx = packet_load(packet.dx), dy = packet_load(packet.dy), dz = packet_load(packet.dz);
+    const PacketFloat cx = packet_set1(center[0]), cy = packet_set1(center[1]), cz = packet_set1(center[2]);
+    const PacketFloat r = packet_set1(radius);
+    const PacketFloat far = packet_set1(maxDist);
+    const PacketFloat surface = packet_set1(surfDist);
+    const PacketFloat zero = packet_set1(0.0f);
+
+    PacketFloat d0 = zero;
+    PacketMask active = packet_all();
+    PacketMask escaped = packet_none();
+    for (int i = 0; i < maxSteps && packet_bits(active); i++)
+    {
+        // p = ray.origin + ray.direction * d0, relative to the sphere center
+        PacketFloat px = packet_sub(packet_add(ox, packet_mul(dx, d0)), cx);
+        PacketFloat py = packet_sub(packet_add(oy, packet_mul(dy, d0)), cy);
+        PacketFloat pz = packet_sub(packet_add(oz, packet_mul(dz, d0)), cz);
+        PacketFloat ds = packet_sub(packet_sqrt(packet_add(packet_add(packet_mul(px, px), packet_mul(py, py)), packet_mul(pz, pz))), r);
+        d0 = packet_add(d0, packet_select(active, ds, zero));
+
+        PacketMask out = packet_and(active, packet_gt(d0, far));
+        PacketMask hit = packet_and(active, packet_lt(d0, surface));
+        escaped = packet_or(escaped, out);
+        active = packet_andnot(packet_or(out, hit), active);
+    }
+    packet.escaped = packet_bits(escaped);
+}
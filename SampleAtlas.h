@@ -0,0 +1,196 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <iostream>
+
+// GLEW
+#include <GL/glew.h>
+
+using namespace std;
+
+// Extra samples of the pixels of the still image that the samples every pixel gets do not
+// resolve. A pass renders how many samples every pixel needs into NeedTexture, ReadNeed()
+// copies it into a pixel buffer in the background and Layout() gives each such pixel a run of
+// texels in the atlas, one per sample beyond the ones it has. The refinement passes then trace
+// the atlas a few rows at a time. The atlas holds G-buffer texels, not colors, so the shading
+// pass can shade every sample with the sky's current rotation.
+class SampleAtlas
+{
+public:
+    // screenWidth x screenHeight pixels, at most width x height extra samples
+    SampleAtlas(GLuint screenWidth, GLuint screenHeight, GLuint width = 2048, GLuint height = 1024)
+        : ScreenWidth(screenWidth), ScreenHeight(screenHeight), Width(width), Height(height), count(0), fence(0)
+    {
+        this->NeedFBO = createTarget(screenWidth, screenHeight, GL_R32F, GL_RED, GL_FLOAT, this->NeedTexture);
+        this->FBO = createTarget(width, height, GL_RGBA32F, GL_RGBA, GL_FLOAT, this->Texture);
+        this->Pixels = createTexture(width, height, GL_RGBA16UI, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT);
+        this->Index = createTexture(screenWidth, screenHeight, GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT);
+        glGenBuffers(1, &this->NeedBuffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, this->NeedBuffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)screenWidth * screenHeight * sizeof(GLfloat), NULL, GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    ~SampleAtlas()
+    {
+        this->Cancel();
+        glDeleteBuffers(1, &this->NeedBuffer);
+        glDeleteFramebuffers(1, &this->NeedFBO);
+        glDeleteFramebuffers(1, &this->FBO);
+        GLuint textures[4] = { this->NeedTexture, this->Texture, this->Pixels, this->Index };
+        glDeleteTextures(4, textures);
+    }
+
+    SampleAtlas(const SampleAtlas&) = delete;
+    SampleAtlas& operator=(const SampleAtlas&) = delete;
+
+    GLuint ScreenWidth;
+    GLuint ScreenHeight;
+    GLuint Width;
+    GLuint Height;
+
+    // R32F: samples each pixel needs, rendered through NeedFBO before Layout()
+    GLuint NeedTexture;
+    GLuint NeedFBO;
+    // pixel buffer ReadNeed() copies NeedTexture into
+    GLuint NeedBuffer;
+    // RGBA32F: G-buffer texel of every extra sample, rendered through FBO
+    GLuint Texture;
+    GLuint FBO;
+    // RGBA16UI: pixel (xy), index among its samples (z, after the ones it has) and its sample
+    // count (w, 0 if the texel is unused) of every atlas texel
+    GLuint Pixels;
+    // RG32UI: first atlas texel and number of extra samples of every pixel
+    GLuint Index;
+
+    // Extra samples laid out by the last Layout(), they fill the atlas in rows from the bottom
+    GLuint Count() const
+    {
+        return this->count;
+    }
+
+    // Copies NeedTexture into NeedBuffer after the pass that renders it, without waiting for
+    // either. Ready() tells when the copy is done.
+    void ReadNeed()
+    {
+        this->Cancel();
+        glBindFramebuffer(GL_FRAMEBUFFER, this->NeedFBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, this->NeedBuffer);
+        glReadPixels(0, 0, this->ScreenWidth, this->ScreenHeight, GL_RED, GL_FLOAT, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        this->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    // Whether a ReadNeed() copy is under way or done and not laid out yet
+    bool Reading() const
+    {
+        return this->fence != 0;
+    }
+
+    // Whether the ReadNeed() copy is done, so that Layout() does not wait for the GPU
+    bool Ready() const
+    {
+        if (!this->fence)
+            return false;
+        GLenum status = glClientWaitSync(this->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+    }
+
+    // Drops the ReadNeed() copy, the need it was of is out of date
+    void Cancel()
+    {
+        if (this->fence)
+            glDeleteSync(this->fence);
+        this->fence = 0;
+    }
+
+    // Lays out the samples beyond the taken ones every pixel has in pixel order, from the
+    // last ReadNeed() copy (which it waits for if it is not Ready()). If they do not fit,
+    // every pixel's extra samples are cut by the same factor. Returns Count().
+    GLuint Layout(GLuint taken = 1)
+    {
+        GLuint pixels = this->ScreenWidth * this->ScreenHeight;
+        this->Cancel();
+        this->count = 0;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, this->NeedBuffer);
+        const GLfloat* need = (const GLfloat*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)pixels * sizeof(GLfloat), GL_MAP_READ_BIT);
+        if (!need) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            return this->count;
+        }
+
+        double wanted = 0.0;
+        for (GLuint i = 0; i < pixels; i++)
+            if (need[i] > taken)
+                wanted += need[i] - taken;
+        double capacity = (double)this->Width * this->Height;
+        double fraction = wanted > capacity ? capacity / wanted : 1.0;
+
+        vector<GLuint> index(pixels * 2, 0);
+        vector<GLushort> texels;
+        for (GLuint i = 0; i < pixels; i++) {
+            GLuint extra = need[i] > taken ? (GLuint)((need[i] - taken) * fraction) : 0;
+            if (extra > this->Width * this->Height - this->count)
+                extra = this->Width * this->Height - this->count;
+            index[2 * i] = this->count;
+            index[2 * i + 1] = extra;
+            for (GLuint j = taken; j < taken + extra; j++) {
+                texels.push_back((GLushort)(i % this->ScreenWidth));
+                texels.push_back((GLushort)(i / this->ScreenWidth));
+                texels.push_back((GLushort)j);
+                texels.push_back((GLushort)(taken + extra));
+            }
+            this->count += extra;
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        glBindTexture(GL_TEXTURE_2D, this->Index);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->ScreenWidth, this->ScreenHeight, GL_RG_INTEGER, GL_UNSIGNED_INT, &index[0]);
+        GLuint rows = this->Rows(this->count);
+        if (rows > 0) {
+            texels.resize((size_t)rows * this->Width * 4, 0);   // the rest of the last row is unused
+            glBindTexture(GL_TEXTURE_2D, this->Pixels);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->Width, rows, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, &texels[0]);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return this->count;
+    }
+
+    // Atlas rows that hold the first samples samples
+    GLuint Rows(GLuint samples) const
+    {
+        return (samples + this->Width - 1) / this->Width;
+    }
+
+private:
+    GLuint count;
+    GLsync fence;
+
+    static GLuint createTexture(GLuint width, GLuint height, GLenum internalFormat, GLenum format, GLenum type)
+    {
+        GLuint textureID;
+        glGenTextures(1, &textureID);
+        glBindTexture(GL_TEXTURE_2D, textureID);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return textureID;
+    }
+
+    static GLuint createTarget(GLuint width, GLuint height, GLenum internalFormat, GLenum format, GLenum type, GLuint& textureID)
+    {
+        textureID = createTexture(width, height, internalFormat, format, type);
+        GLuint framebuffer;
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureID, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "ERROR::FRAMEBUFFER::NOT_COMPLETE" << endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return framebuffer;
+    }
+};
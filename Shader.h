@@ -5,6 +5,15 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 #include <GL/glew.h>// glewȡеıOpenGLͷļ
 
@@ -15,9 +24,11 @@ class Shader
 public:
 	// ID
 	GLuint Program;
+	// Ӻѯuniformλãֻ棬ϷѭвٵglGetUniformLocation
+	map<string, GLint> Uniforms;
 
-	// ȡɫ
-	Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
+	// ȡɫdefinesеĺ뵽ɫ#version֮
+	Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const map<string, string>& defines = map<string, string>())
 	{
 		// 1.ļ·кȥ/Ƭɫ
 		string  vertexCode;
@@ -45,6 +56,15 @@ public:
 		catch (ifstream::failure e) {
 			cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << endl;
 		}
+		vertexCode = InjectDefines(vertexCode, defines);
+		fragmentCode = InjectDefines(fragmentCode, defines);
+
+		// лĳʱֱӼأ
+		string binaryPath = BinaryPath(vertexCode, fragmentCode);
+		if (this->loadBinary(binaryPath)) {
+			this->reflectUniforms();
+			return;
+		}
 		const GLchar* vShaderCode = vertexCode.c_str();
 		const GLchar* fShaderCode = fragmentCode.c_str();
 
@@ -79,6 +99,8 @@ public:
 		this->Program = glCreateProgram();
 		glAttachShader(this->Program, vertex);
 		glAttachShader(this->Program, fragment);
+		if (!binaryPath.empty())
+			glProgramParameteri(this->Program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(this->Program);
 		// ӡӴ
 		glGetProgramiv(this->Program, GL_LINK_STATUS, &success);
@@ -86,10 +108,29 @@ public:
 			glGetProgramInfoLog(this->Program, 512, NULL, infoLog);
 			cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << endl;
 		}
+		else
+			this->saveBinary(binaryPath);
 
 		// ɾɫѾӵǵĳУѾҪ
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
+
+		this->reflectUniforms();
+	}
+
+	// uniformλãڣ򱻱Żʱ-1glGetUniformLocationһ
+	GLint Uniform(const string& name) const
+	{
+		map<string, GLint>::const_iterator it = this->Uniforms.find(name);
+		return it != this->Uniforms.end() ? it->second : -1;
+	}
+
+	// uniform󶨵󶨵㣬ɫûʱʲôҲ
+	void BindUniformBlock(const GLchar* name, GLuint binding)
+	{
+		GLuint index = glGetUniformBlockIndex(this->Program, name);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(this->Program, index, binding);
 	}
 
 	// ʹó
@@ -97,6 +138,177 @@ public:
 	{
 		glUseProgram(this->Program);
 	}
+
+	// #version֮"#define  ֵ"#lineñкźļһ
+	static string InjectDefines(const string& code, const map<string, string>& defines)
+	{
+		if (defines.empty())
+			return code;
+		string lines;
+		for (map<string, string>::const_iterator it = defines.begin(); it != defines.end(); ++it)
+			lines += "#define " + it->first + " " + it->second + "\n";
+		size_t version = code.find("#version");
+		if (version == string::npos)
+			return lines + "#line 1\n" + code;
+		size_t end = code.find('\n', version);
+		if (end == string::npos)
+			return code + "\n" + lines;
+		int line = 1;
+		for (size_t i = 0; i < end; i++)
+			if (code[i] == '\n')
+				line++;
+		ostringstream next;
+		next << "#line " << line + 1 << "\n";
+		return code.substr(0, end + 1) + lines + next.str() + code.substr(end + 1);
+	}
+
+	// ƻĿ¼ַĬϣʱÿζԴ
+	static string& BinaryCacheDirectory()
+	{
+		static string directory;
+		return directory;
+	}
+
+	// ļԴ̡Ⱦ汾ɢɫɵĶơ
+	// ûûĿ¼ֳ֧ʱؿַ
+	static string BinaryPath(const string& vertexCode, const string& fragmentCode)
+	{
+		if (BinaryCacheDirectory().empty() || !(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+			return "";
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		if (formats <= 0)
+			return "";
+		unsigned long long hash = Hash(vertexCode);
+		hash = Hash(string(1, '\0') + fragmentCode, hash);
+		const GLenum driver[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (int i = 0; i < 3; i++) {
+			const GLubyte* name = glGetString(driver[i]);
+			hash = Hash(string(1, '\0') + (name ? (const char*)name : ""), hash);
+		}
+		char file[32];
+		snprintf(file, sizeof(file), "%016llx.bin", hash);
+		return BinaryCacheDirectory() + "/" + file;
+	}
+
+	// 64λFNV-1aɢ
+	static unsigned long long Hash(const string& text, unsigned long long hash = 14695981039346656037ULL)
+	{
+		for (size_t i = 0; i < text.size(); i++) {
+			hash ^= (unsigned char)text[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+private:
+	// ӻļļڻܾʱfalseɵߴԴ
+	bool loadBinary(const string& path)
+	{
+		if (path.empty())
+			return false;
+		ifstream file(path.c_str(), ios::binary);
+		char magic[4];
+		GLenum format;
+		GLint length;
+		file.read(magic, 4);
+		file.read((char*)&format, sizeof(format));
+		file.read((char*)&length, sizeof(length));
+		if (!file || memcmp(magic, "BHPB", 4) != 0 || length <= 0)
+			return false;
+		vector<char> binary(length);
+		file.read(&binary[0], length);
+		if (!file)
+			return false;
+
+		this->Program = glCreateProgram();
+		glProgramBinary(this->Program, format, &binary[0], length);
+		GLint success;
+		glGetProgramiv(this->Program, GL_LINK_STATUS, &success);
+		if (!success) {
+			glDeleteProgram(this->Program);
+			this->Program = 0;
+			return false;
+		}
+		return true;
+	}
+
+	// Ӻõĳдļ
+	void saveBinary(const string& path)
+	{
+		if (path.empty())
+			return;
+		GLint length = 0;
+		glGetProgramiv(this->Program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		vector<char> binary(length);
+		GLenum format;
+		glGetProgramBinary(this->Program, length, &length, &format, &binary[0]);
+#ifdef _WIN32
+		_mkdir(BinaryCacheDirectory().c_str());
+#else
+		mkdir(BinaryCacheDirectory().c_str(), 0755);
+#endif
+		ofstream file(path.c_str(), ios::binary);
+		file.write("BHPB", 4);
+		file.write((const char*)&format, sizeof(format));
+		file.write((const char*)&length, sizeof(length));
+		file.write(&binary[0], length);
+		if (!file)
+			cout << "ERROR::SHADER::BINARY_NOT_WRITTEN " << path << endl;
+	}
+
+	// лuniformλãuniformеĳԱûλã
+	void reflectUniforms()
+	{
+		this->Uniforms.clear();
+		GLint count = 0;
+		glGetProgramiv(this->Program, GL_ACTIVE_UNIFORMS, &count);
+		for (GLint i = 0; i < count; i++) {
+			GLchar name[256];
+			GLsizei length;
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(this->Program, i, sizeof(name), &length, &size, &type, name);
+			GLint location = glGetUniformLocation(this->Program, name);
+			if (location < 0)
+				continue;
+			string key(name, length);
+			// "name[0]"أҲ"name"
+			if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+				this->Uniforms[key.substr(0, key.size() - 3)] = location;
+			this->Uniforms[key] = location;
+		}
+	}
+};
+
+// ɫ建棺ͬһɫļͬĺһΣ֮л岻ٱ
+class ShaderCache
+{
+public:
+	// ĳ򣬵һõʱ
+	Shader& Get(const GLchar* vertexPath, const GLchar* fragmentPath, const map<string, string>& defines = map<string, string>())
+	{
+		string key = string(vertexPath) + "|" + fragmentPath;
+		for (map<string, string>::const_iterator it = defines.begin(); it != defines.end(); ++it)
+			key += "|" + it->first + "=" + it->second;
+		map<string, Shader>::iterator found = this->programs.find(key);
+		if (found == this->programs.end())
+			found = this->programs.insert(make_pair(key, Shader(vertexPath, fragmentPath, defines))).first;
+		return found->second;
+	}
+
+	// ɾбĳ
+	void Clear()
+	{
+		for (map<string, Shader>::iterator it = this->programs.begin(); it != this->programs.end(); ++it)
+			glDeleteProgram(it->second.Program);
+		this->programs.clear();
+	}
+
+private:
+	map<string, Shader> programs;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+#pragma once
+
+// Std. Includes
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+
+using namespace std;
+
+// A fixed set of worker threads with one task queue each. ParallelFor() deals a contiguous
+// block of indices to every queue; a worker takes from the back of its own queue and, once
+// it runs dry, steals from the front of the others. Cheap items (sky tiles) therefore never
+// leave a core idle while another core is still stuck with expensive ones.
+// Submit() queues a job that runs in the background; workers only take jobs when there are no
+// items left, so a ParallelFor() is never stuck behind them for longer than they take.
+class ThreadPool
+{
+public:
+    // threadCount 0 means one worker per hardware thread
+    ThreadPool(unsigned threadCount = 0) : task(nullptr), generation(0), remaining(0), stopping(false), reporting(false)
+    {
+        if (threadCount == 0)
+            threadCount = thread::hardware_concurrency();
+        if (threadCount == 0)
+            threadCount = 1;
+        for (unsigned i = 0; i < threadCount; i++)
+            this->queues.push_back(unique_ptr<Queue>(new Queue()));
+        for (unsigned i = 0; i < threadCount; i++)
+            this->workers.push_back(thread(&ThreadPool::run, this, i));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(this->lock);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (size_t i = 0; i < this->workers.size(); i++)
+            this->workers[i].join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // The queues are all there before the first worker starts, unlike the workers themselves
+    unsigned Size() const
+    {
+        return (unsigned)this->queues.size();
+    }
+
+    // Runs task(i) for every i in [0, count) on the workers and returns when all are done. The
+    // calling thread takes items too, so the items get done even while all workers are busy
+    // with jobs.
+    void ParallelFor(int count, const function<void(int)>& task)
+    {
+        if (count <= 0)
+            return;
+
+        this->start(count, task, false);
+        int item;
+        while (this->pop(0, item))
+            this->execute(item);
+        unique_lock<mutex> lock(this->lock);
+        this->done.wait(lock, [this] { return this->remaining == 0; });
+        this->task = nullptr;
+    }
+
+    // Same as above, but the calling thread runs finished(i) as soon as task(i) has returned,
+    // in completion order, while the workers go on with the other items. Meant for handing
+    // results to something only the caller may touch, like its OpenGL context.
+    void ParallelFor(int count, const function<void(int)>& task, const function<void(int)>& finished)
+    {
+        if (count <= 0)
+            return;
+
+        this->start(count, task, true);
+        unique_lock<mutex> lock(this->lock);
+        for (int reported = 0; reported < count; reported++) {
+            this->done.wait(lock, [this] { return !this->finishedItems.empty(); });
+            int item = this->finishedItems.front();
+            this->finishedItems.pop_front();
+            lock.unlock();
+            finished(item);
+            lock.lock();
+        }
+        this->task = nullptr;
+    }
+
+    // Runs job on a worker once no ParallelFor() items are waiting and returns at once. The
+    // future is ready when the job has returned, or broken if the pool is destroyed before the
+    // job started. Jobs must not call ParallelFor(), the pool runs one of those at a time.
+    future<void> Submit(const function<void()>& job)
+    {
+        shared_ptr<packaged_task<void()>> packaged(new packaged_task<void()>(job));
+        future<void> result = packaged->get_future();
+        {
+            lock_guard<mutex> lock(this->lock);
+            this->jobs.push_back([packaged] { (*packaged)(); });
+        }
+        this->wake.notify_one();
+        return result;
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<int> items;
+    };
+
+    vector<thread> workers;
+    vector<unique_ptr<Queue>> queues;
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int)>* task;
+    unsigned generation;
+    atomic<int> remaining;
+    bool stopping;
+    // Whether workers hand every item they finish to the caller through finishedItems
+    bool reporting;
+    deque<int> finishedItems;
+    deque<function<void()>> jobs;
+
+    // Deals the items to the queues and wakes the workers
+    void start(int count, const function<void(int)>& task, bool reporting)
+    {
+        this->task = &task;
+        this->reporting = reporting;
+        this->remaining = count;
+        unsigned n = this->Size();
+        for (unsigned q = 0; q < n; q++) {
+            int first = (int)((long long)count * q / n);
+            int last = (int)((long long)count * (q + 1) / n);
+            lock_guard<mutex> lock(this->queues[q]->lock);
+            for (int i = first; i < last; i++)
+                this->queues[q]->items.push_back(i);
+        }
+
+        lock_guard<mutex> lock(this->lock);
+        this->generation++;
+        this->wake.notify_all();
+    }
+
+    // Own queue first (newest item), then the oldest item of every other queue in turn
+    bool pop(unsigned self, int& item)
+    {
+        {
+            Queue& own = *this->queues[self];
+            lock_guard<mutex> lock(own.lock);
+            if (!own.items.empty()) {
+                item = own.items.back();
+                own.items.pop_back();
+                return true;
+            }
+        }
+        unsigned n = this->Size();
+        for (unsigned k = 1; k < n; k++) {
+            Queue& victim = *this->queues[(self + k) % n];
+            lock_guard<mutex> lock(victim.lock);
+            if (!victim.items.empty()) {
+                item = victim.items.front();
+                victim.items.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Runs an item of the current ParallelFor() and counts it as done
+    void execute(int item)
+    {
+        (*this->task)(item);
+        if (this->reporting) {
+            lock_guard<mutex> lock(this->lock);
+            this->finishedItems.push_back(item);
+            this->remaining--;
+            this->done.notify_all();
+        }
+        else if (--this->remaining == 0) {
+            lock_guard<mutex> lock(this->lock);
+            this->done.notify_all();
+        }
+    }
+
+    void run(unsigned self)
+    {
+        unsigned seen = 0;
+        while (true)
+        {
+            int item;
+            while (this->pop(self, item))
+                this->execute(item);
+
+            // Items are queued before the generation changes, so a new ParallelFor() is never missed
+            function<void()> job;
+            {
+                unique_lock<mutex> lock(this->lock);
+                this->wake.wait(lock, [&] { return this->stopping || this->generation != seen || !this->jobs.empty(); });
+                if (this->stopping)
+                    return;
+                if (this->generation != seen) {
+                    seen = this->generation;
+                    continue;
+                }
+                job = this->jobs.front();
+                this->jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
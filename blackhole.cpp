@@ -1,6 +1,11 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <future>
+#include <chrono>
 
 // GLEW
 #define GLEW_STATIC
@@ -15,17 +20,63 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <SOIL/SOIL.h>
+extern "C" {
+#include <SOIL/image_DXT.h>
+}
 #include <hdrloader.h>
 
 // Other includes
 #include "Shader.h"
 #include "Camera.h"
+#include "CpuRenderer.h"
+#include "CubemapStream.h"
+#include "DynamicResolution.h"
+#include "SampleAtlas.h"
 
 // Properties
 GLuint screenWidth = 1600, screenHeight = 900;
 const float PI = 3.1415926;
-
-GLuint loadCubemap(vector<const GLchar*> faces);
+GLfloat tolerance = 1e-5f;  // RK45 error tolerance of the geodesic integrator
+const int deflectionTableSize = 4096;
+// Deflection tables for a range of radii, baked offline with blackhole_cpu --bake-tables
+const GLchar* deflectionTablesPath = "resources/deflection.bin";
+// Angle of the shadow proxy's cone relative to the shadow's, leaves room for the texel and row
+// interpolation of the deflection table at the shadow edge
+const double shadowProxyScale = 0.9;
+// GPU time a frame that traces the G-buffer may take, its resolution is lowered to hold it
+const double frameBudget = 1.0 / 60.0;
+// Resolution of the G-buffer while the camera moves, at most half and at least a quarter of
+// the screen's per axis. The shading pass upsamples it and traces the edges it cannot fill.
+const float minGeometryScale = 0.25f, maxGeometryScale = 0.5f;
+// Samples per pixel the still image is refined with, one full screen layer of them a frame once
+// the camera stops, and how much tighter than tolerance the RK45 integrator traces them. The
+// first is the pixel center traced again.
+const GLuint refineSamples = 8;
+const GLfloat refineTolerance = 1.0f / 16.0f;
+// Extra samples the refinement passes may trace in a frame once the layers are in, in full
+// screens of pixels. They go only to the pixels that the layers' samples do not resolve.
+const double refineBudget = 0.5;
+
+// Same std140 layout as the Frame uniform block in blackhole.frag, vec3s take up a vec4
+struct FrameUniforms {
+    glm::vec4 lower_left_corner;
+    glm::vec4 horizontal;
+    glm::vec4 vertical;
+    glm::vec4 origin;
+    glm::mat4 inverseView;
+    glm::mat4 skyRotation;
+    glm::vec3 holeCenter;
+    GLfloat padding;
+};
+
+GLuint loadCubemap(vector<const GLchar*> faces, ThreadPool* pool = nullptr);
+GLuint loadCubemapDDS(const GLchar* path);
+GLuint loadDeflectionTable(const DeflectionTable& table);
+void updateDeflectionTable(GLuint textureID, const DeflectionTable& table);
+GLuint createGeometryBuffer(GLuint width, GLuint height, GLuint& textureID, GLuint& renderbufferID);
+GLuint createSampleLayers(GLuint width, GLuint height, GLuint layers, GLuint& textureID);
+Shader& rayTrackingPermutation(ShaderCache& shaders, Integrator method, bool refinement = false);
+void setupRayTrackingPermutation(Shader& permutation);
 
 // Function prototypes
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
@@ -42,6 +93,10 @@ bool firstMouse = true;
 GLfloat deltaTime = 0.0f;
 GLfloat lastFrame = 0.0f;
 
+// How the ray tracking shader follows the rays, switched with the number keys:
+// 1 deflection table, 2 RK45 geodesics, 3 straight sphere tracing (the original shader)
+Integrator integrator = LOOKUP_TABLE;
+
 // The MAIN function, from here we start our application and run our Game loop
 int main()
 {
@@ -72,61 +127,33 @@ int main()
 
     // Setup some OpenGL options
     glEnable(GL_DEPTH_TEST);
+    // Filter across cube face edges, or the seams show up as lines in the lower mip levels
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
     // Setup and compile our shaders
     //Shader shader("myShader.vs", "myShader.frag");
     //Shader skyboxShader("skybox.vs", "skybox.frag");
-    Shader rayTrackingShader("blackhole.vs", "blackhole.frag");
+    // Linked programs are kept in cache/ and reloaded on the next start if the driver supports
+    // program binaries, otherwise every start compiles from source
+    Shader::BinaryCacheDirectory() = "cache";
+    ShaderCache shaders;
+    Shader shadowShader("shadow.vs", "shadow.frag");
+
+    // All permutations are compiled up front so that switching does not stall, the ones with
+    // the refinement passes once the camera first holds still
+    Integrator integrators[] = { LOOKUP_TABLE, DORMAND_PRINCE, SPHERE_TRACE };
+    for (int i = 0; i < 3; i++)
+        setupRayTrackingPermutation(rayTrackingPermutation(shaders, integrators[i]));
+    GLuint frameUBO;
+    glGenBuffers(1, &frameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, frameUBO);
 
 #pragma region "object_initialization"
     // Set the object data (buffers, vertex attributes)
 
-    // skybox
-    float skyboxVertices[] = {
-        // positions          
-        -1.0f,  1.0f, -1.0f,
-        -1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-         1.0f,  1.0f, -1.0f,
-        -1.0f,  1.0f, -1.0f,
-
-        -1.0f, -1.0f,  1.0f,
-        -1.0f, -1.0f, -1.0f,
-        -1.0f,  1.0f, -1.0f,
-        -1.0f,  1.0f, -1.0f,
-        -1.0f,  1.0f,  1.0f,
-        -1.0f, -1.0f,  1.0f,
-
-         1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-
-        -1.0f, -1.0f,  1.0f,
-        -1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f, -1.0f,  1.0f,
-        -1.0f, -1.0f,  1.0f,
-
-        -1.0f,  1.0f, -1.0f,
-         1.0f,  1.0f, -1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-        -1.0f,  1.0f,  1.0f,
-        -1.0f,  1.0f, -1.0f,
-
-        -1.0f, -1.0f, -1.0f,
-        -1.0f, -1.0f,  1.0f,
-         1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-        -1.0f, -1.0f,  1.0f,
-         1.0f, -1.0f,  1.0f
-    };
-
     // sphere
     const float r = 0.8f;
     const int stacks = 50, sectors = 2 * stacks;
@@ -193,26 +220,17 @@ int main()
     glEnableVertexAttribArray(0);
     glBindVertexArray(0); // Unbind VAO
 
-    // Setup skybox VAO
-    GLuint skyboxVAO, skyboxVBO;
-    glGenVertexArrays(1, &skyboxVAO);
-    glGenBuffers(1, &skyboxVBO);
-    glBindVertexArray(skyboxVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
-    glBindVertexArray(0);
-
     // Setup rectangle VAO
-    GLuint rayVAO, rayEBO;
+    GLuint rayVAO, rayVBO, rayEBO;
     glGenVertexArrays(1, &rayVAO);
+    glGenBuffers(1, &rayVBO);
     glGenBuffers(1, &rayEBO);
     // Bind the Vertex Array Object first, then bind and set vertex buffer(s) and attribute pointer(s).
     glBindVertexArray(rayVAO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(rectangleVertices) * sizeof(float), &rectangleVertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, rayVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(rectangleVertices), &rectangleVertices, GL_STATIC_DRAW);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, rayEBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(rectangleIndices) * sizeof(int), &rectangleIndices, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(rectangleIndices), &rectangleIndices, GL_STATIC_DRAW);
     // Position attribute
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
     glEnableVertexAttribArray(0);
@@ -233,7 +251,73 @@ int main()
     faces.push_back("resources/skybox/bottom.png");
     faces.push_back("resources/skybox/front.png");
     faces.push_back("resources/skybox/back.png");
-    GLuint cubemapTexture = loadCubemap(faces);
+    // 512x512 downscale of the same sky, drawn until the full resolution faces have streamed in
+    vector<const GLchar*> faces_preview;
+    faces_preview.push_back("resources/skybox_preview/right.png");
+    faces_preview.push_back("resources/skybox_preview/left.png");
+    faces_preview.push_back("resources/skybox_preview/top.png");
+    faces_preview.push_back("resources/skybox_preview/bottom.png");
+    faces_preview.push_back("resources/skybox_preview/front.png");
+    faces_preview.push_back("resources/skybox_preview/back.png");
+    ThreadPool pool;
+    // The compressed cubemap baked by blackhole_cpu --bake-skybox needs no decoding, without it
+    // the preview is shown while the PNG faces stream in
+    GLuint cubemapTexture = loadCubemapDDS("resources/skybox.dds");
+    unique_ptr<CubemapStream> skyboxStream;
+    if (!cubemapTexture) {
+        cubemapTexture = loadCubemap(faces_preview, &pool);
+        skyboxStream.reset(new CubemapStream(vector<string>(faces.begin(), faces.end()), pool));
+    }
+
+    // Deflection table of the camera's distance to the hole, traced on the CPU. Looking around
+    // does not change it, so it is only traced again when the camera moves to another radius
+    // that the baked tables (if there are any) do not cover.
+    CpuRenderer tracer(nullptr, CreateRayCamera(camera.Zoom, (double)screenWidth / (double)screenHeight), glm::dmat3(1.0), 0.0);
+    tracer.March = DeflectionTableSettings();
+    double radius = glm::length(HOLE_POSITION - glm::dvec3(camera.Position));
+    DeflectionTable table;
+    tracer.BuildDeflectionTable(table, deflectionTableSize, 1, radius, radius, &pool);
+    GLuint deflectionTexture = loadDeflectionTable(table);
+    // Tables of other radii are traced on the pool in the background, the last one is drawn
+    // with until the next is done
+    DeflectionTable rebuiltTable;
+    future<void> rebuild;
+    DeflectionTable bakedTables;
+    GLuint bakedTexture = 0;
+    if (ifstream(deflectionTablesPath).good() && bakedTables.Load(deflectionTablesPath, tracer.Hole.radius))
+        bakedTexture = loadDeflectionTable(bakedTables);
+
+    // G-buffers of the lensing pass and the camera the current one was traced for. There are
+    // two so that the geometry pass can reuse texels of the last one (see ReprojectGeometry in
+    // blackhole.frag) while it traces the other.
+    GLuint geometryTextures[2];
+    GLuint geometryRenderbuffers[2];
+    GLuint geometryFBOs[2];
+    for (int i = 0; i < 2; i++)
+        geometryFBOs[i] = createGeometryBuffer(screenWidth, screenHeight, geometryTextures[i], geometryRenderbuffers[i]);
+    int geometryCurrent = 0;
+    bool geometryValid = false;
+    Integrator geometryIntegrator = integrator;
+    glm::mat4 geometryView(1.0f);
+    glm::vec3 geometryPosition(0.0f);
+    glm::vec4 geometryFrustum(0.0f);
+    GLint geometryPasses = 0;
+    // The G-buffer is traced at a lower resolution while the camera moves, lower still if that
+    // takes too long, and again at full resolution once it stops
+    unique_ptr<DynamicResolution> resolution(new DynamicResolution(frameBudget, minGeometryScale, maxGeometryScale));
+    GLuint geometryWidth = screenWidth, geometryHeight = screenHeight;
+    // Jittered samples of every pixel of the still image, a layer each (see TraceLayer in
+    // blackhole.frag), and how many layers are traced. Created the first time the camera holds
+    // still, a camera that never stops needs none of them.
+    GLuint layersTexture = 0;
+    GLuint layersFBO = 0;
+    GLuint refinedLayers = 0;
+    // Extra samples of the pixels of the still image that need more than the layers', and how
+    // many of them are traced. Created with the layers, laid out once they are traced, 0 while
+    // the camera moves.
+    unique_ptr<SampleAtlas> atlas;
+    bool atlasLaidOut = false;
+    GLuint refinedSamples = 0;
 
 #pragma endregion
 
@@ -249,6 +333,19 @@ int main()
         glfwPollEvents();
         Do_Movement();
 
+        // Swap in the full resolution skybox once all of its faces are uploaded. The G-buffer
+        // only holds directions, so the next shading pass picks it up without a geometry pass.
+        if (skyboxStream) {
+            GLuint streamed = skyboxStream->Update();
+            if (streamed) {
+                glDeleteTextures(1, &cubemapTexture);
+                cubemapTexture = streamed;
+                skyboxStream.reset();
+            }
+            else if (skyboxStream->Failed())
+                skyboxStream.reset();
+        }
+
         // Clear the colorbuffer
         glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -284,6 +381,7 @@ int main()
         //glBindVertexArray(0);
 
         // ray tracking
+        Shader& rayTrackingShader = rayTrackingPermutation(shaders, integrator, layersFBO != 0);
         rayTrackingShader.Use();
 
         // Initialize matrix
@@ -311,41 +409,275 @@ int main()
         view = glm::mat4(glm::mat3(camera.GetViewMatrix()));	// Remove any translation component of the view matrix
         projection = glm::perspective(camera.Zoom, aspect, near, far);
         //ratote = glm::rotate(ratote, (GLfloat)glfwGetTime() * 0.1f, glm::vec3(0.0f, 1.0f, 0.0f));    // rotate skybox
-        glUniformMatrix4fv(glGetUniformLocation(rayTrackingShader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(rayTrackingShader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
         //glUniformMatrix4fv(glGetUniformLocation(rayTrackingShader.Program, "ratote"), 1, GL_FALSE, glm::value_ptr(ratote));
-        // skybox cube
-        glBindVertexArray(skyboxVAO);
+        // The lensing passes sample the skybox from unit 0
         glActiveTexture(GL_TEXTURE0);
-        glUniform1i(glGetUniformLocation(rayTrackingShader.Program, "skybox"), 0);
         glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
         //glDepthMask(GL_TRUE);
 
-        glUniform1f(glGetUniformLocation(rayTrackingShader.Program, "time"), (GLfloat)glfwGetTime() * 0.07f);
-        glUniform3f(glGetUniformLocation(rayTrackingShader.Program, "camera.lower_left_corner"), lower_left_corner.x, lower_left_corner.y, lower_left_corner.z);
-        glUniform3f(glGetUniformLocation(rayTrackingShader.Program, "camera.horizontal"), horizontal.x, horizontal.y, horizontal.z);
-        glUniform3f(glGetUniformLocation(rayTrackingShader.Program, "camera.vertical"), vertical.x, vertical.y, vertical.z);
-        glUniform3f(glGetUniformLocation(rayTrackingShader.Program, "camera.origin"), 0.0, 0.0, 0.0);
+        // Deflection table: the baked rows around the camera's radius, or its own table
+        radius = glm::length(HOLE_POSITION - glm::dvec3(camera.Position));
+        bool tableSwapped = false;
+        if (rebuild.valid() && rebuild.wait_for(chrono::seconds(0)) == future_status::ready) {
+            rebuild.get();
+            swap(table, rebuiltTable);
+            updateDeflectionTable(deflectionTexture, table);
+            tableSwapped = true;
+        }
+        glActiveTexture(GL_TEXTURE1);
+        if (bakedTables.Covers(radius)) {
+            glBindTexture(GL_TEXTURE_2D, bakedTexture);
+            glUniform1f(rayTrackingShader.Uniform("deflectionRow"), (GLfloat)bakedTables.RowCoord(radius));
+            tableSwapped = false;
+        }
+        else {
+            // One table at a time, without the pool's ParallelFor (only one can run at once)
+            if (radius != table.MinRadius && !rebuild.valid()) {
+                double rebuiltRadius = radius;
+                rebuild = pool.Submit([&tracer, &rebuiltTable, rebuiltRadius] {
+                    tracer.BuildDeflectionTable(rebuiltTable, deflectionTableSize, 1, rebuiltRadius, rebuiltRadius);
+                });
+            }
+            glBindTexture(GL_TEXTURE_2D, deflectionTexture);
+            glUniform1f(rayTrackingShader.Uniform("deflectionRow"), 0.5f);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glm::vec3 holeCenter = glm::mat3(view) * (glm::vec3(HOLE_POSITION) - camera.Position);
+        glUniform1f(rayTrackingShader.Uniform("tolerance"), tolerance);
+
+        // Per-frame uniforms, with the matrices the shader would otherwise build per pixel
+        FrameUniforms frame;
+        frame.lower_left_corner = glm::vec4(lower_left_corner, 0.0f);
+        frame.horizontal = glm::vec4(horizontal, 0.0f);
+        frame.vertical = glm::vec4(vertical, 0.0f);
+        frame.origin = glm::vec4(0.0f);
+        frame.inverseView = glm::inverse(view);
+        frame.skyRotation = glm::mat4(glm::mat3(SkyRotation((GLfloat)glfwGetTime() * 0.07f)));
+        frame.holeCenter = holeCenter;
+        frame.padding = 0.0f;
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
         
+        // Geometry pass: the rays only change when the camera moves or turns, so their escaped
+        // directions are traced into the G-buffer then and reused by every later frame
+        resolution->Update();
+        bool moved = !geometryValid || view != geometryView || camera.Position != geometryPosition || integrator != geometryIntegrator;
+        bool sharpen = !moved && (geometryWidth != screenWidth || geometryHeight != screenHeight);
+        // The table of the radius the camera stopped at comes in after the still image was
+        // traced with an older one. While the camera moves the next geometry pass picks it up.
+        bool retrace = !moved && tableSwapped && integrator == LOOKUP_TABLE;
+        if (moved || sharpen || retrace) {
+            // The last G-buffer is reused where it still holds while the camera moves, the
+            // sharpening pass traces everything at full resolution
+            bool reprojecting = geometryValid && moved && integrator == geometryIntegrator;
+            glUniform1i(rayTrackingShader.Uniform("reprojecting"), reprojecting);
+            glUniform2f(rayTrackingShader.Uniform("previousScale"), (GLfloat)geometryWidth / screenWidth, (GLfloat)geometryHeight / screenHeight);
+            glUniformMatrix3fv(rayTrackingShader.Uniform("previousView"), 1, GL_FALSE, glm::value_ptr(glm::mat3(geometryView)));
+            glUniform4fv(rayTrackingShader.Uniform("previousFrustum"), 1, glm::value_ptr(geometryFrustum));
+            glUniform1f(rayTrackingShader.Uniform("previousShift"), (GLfloat)(glm::length(camera.Position - geometryPosition) / radius));
+            glUniform1i(rayTrackingShader.Uniform("refreshTile"), geometryPasses++);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, geometryTextures[geometryCurrent]);
+            geometryCurrent = 1 - geometryCurrent;
+
+            if (moved) {
+                geometryWidth = resolution->Size(screenWidth);
+                geometryHeight = resolution->Size(screenHeight);
+                resolution->Begin();
+            }
+            else {
+                geometryWidth = screenWidth;
+                geometryHeight = screenHeight;
+            }
+            glViewport(0, 0, geometryWidth, geometryHeight);
+            glUniform2f(rayTrackingShader.Uniform("geometryScale"), (GLfloat)geometryWidth / screenWidth, (GLfloat)geometryHeight / screenHeight);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, 0);    // not sampled while it is rendered to
+            glActiveTexture(GL_TEXTURE0);
+            glBindFramebuffer(GL_FRAMEBUFFER, geometryFBOs[geometryCurrent]);
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);   // captured
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+            // Shadow proxy: rays closer than the critical angle asin(b_c / r) to the hole are
+            // captured. Seen from the camera, a sphere around the hole covers such a cone, so the
+            // sphere mesh is drawn into the stencil buffer and the ray shader skips its pixels.
+            // Straight sphere tracing has no photon sphere and only loses the hole itself.
+            if (integrator != SPHERE_TRACE && radius > 1.5 * tracer.Hole.radius) {
+                double shadowAngle = asin(glm::min(2.598076211353316 * tracer.Hole.radius / radius, 1.0)) * shadowProxyScale;
+                GLfloat proxyRadius = (GLfloat)(radius * sin(shadowAngle));
+                GLfloat proxyNear = 0.5f * ((GLfloat)radius - proxyRadius);
+                // Same frustum as the camera uniform: horizontal field of view Zoom on the z = -1 plane
+                GLfloat halfWidth = proxyNear * tan(camera.Zoom / 2);
+                glm::mat4 proxyProjection = glm::frustum(-halfWidth, halfWidth, -halfWidth / aspect, halfWidth / aspect, proxyNear, (GLfloat)radius + proxyRadius + 1.0f);
+                glm::mat4 proxyModel = glm::translate(glm::mat4(1.0f), holeCenter);
+                proxyModel = glm::scale(proxyModel, glm::vec3(proxyRadius / r));
+                shadowShader.Use();
+                glUniformMatrix4fv(shadowShader.Uniform("projection"), 1, GL_FALSE, glm::value_ptr(proxyProjection));
+                glUniformMatrix4fv(shadowShader.Uniform("model"), 1, GL_FALSE, glm::value_ptr(proxyModel));
+                glEnable(GL_STENCIL_TEST);
+                glStencilFunc(GL_ALWAYS, 1, 0xFF);
+                glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                glDepthMask(GL_FALSE);
+                glBindVertexArray(VAO);
+                glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, 0);
+                glBindVertexArray(0);
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                glDepthMask(GL_TRUE);
+                glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
+                glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+                rayTrackingShader.Use();
+            }
 
+            glUniform1i(rayTrackingShader.Uniform("lensingPass"), 1);
+            glBindVertexArray(rayVAO);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            glBindVertexArray(0);
+            glDisable(GL_STENCIL_TEST);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(0, 0, screenWidth, screenHeight);
+            geometryValid = true;
+            geometryView = view;
+            geometryPosition = camera.Position;
+            geometryIntegrator = integrator;
+            geometryFrustum = glm::vec4(lower_left_corner.x, lower_left_corner.y, horizontal.x, vertical.y);
+            refinedLayers = 0;
+            atlasLaidOut = false;
+            refinedSamples = 0;
+            if (atlas)
+                atlas->Cancel();
+        }
+        // The first time the camera holds still the layers and the atlas are created and the
+        // permutations with the refinement passes compiled, they are used from the next frame on
+        else if (!layersFBO) {
+            layersFBO = createSampleLayers(screenWidth, screenHeight, refineSamples, layersTexture);
+            atlas.reset(new SampleAtlas(screenWidth, screenHeight));
+            for (int i = 0; i < 3; i++)
+                setupRayTrackingPermutation(rayTrackingPermutation(shaders, integrators[i], true));
+            rayTrackingShader.Use();
+        }
+        // Progressive refinement: while no key moves the camera and the mouse does not turn it,
+        // every frame traces one more sample of every pixel, at the next offset of the R2
+        // sequence and at the tighter tolerance, into the next layer. The shading pass shades
+        // each sample with the sky's current rotation and averages them.
+        else if (refinedLayers < refineSamples) {
+            glDisable(GL_DEPTH_TEST);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, geometryTextures[geometryCurrent]);
+            glActiveTexture(GL_TEXTURE7);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, 0);  // not sampled while it is rendered to
+            glActiveTexture(GL_TEXTURE0);
+            glBindFramebuffer(GL_FRAMEBUFFER, layersFBO);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, layersTexture, 0, refinedLayers);
+            glUniform1f(rayTrackingShader.Uniform("tolerance"), tolerance * refineTolerance);
+            glUniform1i(rayTrackingShader.Uniform("lensingPass"), 3);
+            glUniform1i(rayTrackingShader.Uniform("sampleLayer"), refinedLayers);
+            glBindVertexArray(rayVAO);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            glBindVertexArray(0);
+            glUniform1f(rayTrackingShader.Uniform("tolerance"), tolerance);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glEnable(GL_DEPTH_TEST);
+            refinedLayers++;
+        }
+        // Refinement passes: then the pixels that these samples still do not resolve get more on
+        // top of them. SampleNeed in blackhole.frag picks how many from the full resolution
+        // G-buffer and the layers, which do not change while the sky rotates. Its readback is
+        // laid out in the first frame it is done in, then every frame traces the next rows of
+        // their samples until it has traced refineBudget.
+        else if (!atlasLaidOut || refinedSamples < atlas->Count()) {
+            glDisable(GL_DEPTH_TEST);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, geometryTextures[geometryCurrent]);
+            glActiveTexture(GL_TEXTURE4);
+            glBindTexture(GL_TEXTURE_2D, 0);    // not sampled while it is rendered to
+            glActiveTexture(GL_TEXTURE0);
+            glBindVertexArray(rayVAO);
+            if (!atlasLaidOut && !atlas->Reading()) {
+                glActiveTexture(GL_TEXTURE7);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, layersTexture);
+                glActiveTexture(GL_TEXTURE0);
+                glBindFramebuffer(GL_FRAMEBUFFER, atlas->NeedFBO);
+                glUniform1i(rayTrackingShader.Uniform("lensingPass"), 5);
+                glUniform1i(rayTrackingShader.Uniform("refinedLayers"), refinedLayers);
+                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                atlas->ReadNeed();
+            }
+            else if (!atlasLaidOut && atlas->Ready()) {
+                atlas->Layout(refineSamples);
+                atlasLaidOut = true;
+                refinedSamples = 0;
+            }
+            GLuint rows = (GLuint)(refineBudget * screenWidth * screenHeight / atlas->Width);
+            GLuint first = refinedSamples / atlas->Width;
+            rows = atlasLaidOut ? glm::min(glm::max(rows, 1u), atlas->Rows(atlas->Count()) - first) : 0;
+            if (rows > 0) {
+                glActiveTexture(GL_TEXTURE5);
+                glBindTexture(GL_TEXTURE_2D, atlas->Pixels);
+                glActiveTexture(GL_TEXTURE0);
+                glBindFramebuffer(GL_FRAMEBUFFER, atlas->FBO);
+                glViewport(0, 0, atlas->Width, atlas->Height);
+                glEnable(GL_SCISSOR_TEST);
+                glScissor(0, first, atlas->Width, rows);
+                glUniform1f(rayTrackingShader.Uniform("tolerance"), tolerance * refineTolerance);
+                glUniform1i(rayTrackingShader.Uniform("lensingPass"), 4);
+                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                glUniform1f(rayTrackingShader.Uniform("tolerance"), tolerance);
+                glDisable(GL_SCISSOR_TEST);
+                glViewport(0, 0, screenWidth, screenHeight);
+                refinedSamples = glm::min((first + rows) * atlas->Width, atlas->Count());
+            }
+            glBindVertexArray(0);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glEnable(GL_DEPTH_TEST);
+        }
+
+        // Shading pass: a G-buffer and a skybox fetch per pixel, with this frame's sky rotation
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, geometryTextures[geometryCurrent]);
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, atlas ? atlas->Texture : 0);
+        glActiveTexture(GL_TEXTURE6);
+        glBindTexture(GL_TEXTURE_2D, atlas ? atlas->Index : 0);
+        glActiveTexture(GL_TEXTURE7);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, layersTexture);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(rayTrackingShader.Uniform("lensingPass"), 2);
+        glUniform1i(rayTrackingShader.Uniform("refinedSamples"), atlasLaidOut ? (GLint)refinedSamples : -1);
+        glUniform1i(rayTrackingShader.Uniform("refinedLayers"), refinedLayers);
+        glUniform2f(rayTrackingShader.Uniform("geometryScale"), (GLfloat)geometryWidth / screenWidth, (GLfloat)geometryHeight / screenHeight);
         glBindVertexArray(rayVAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
         glBindVertexArray(0);
+        resolution->End();
 
         // Swap the buffers
         glfwSwapBuffers(window);
     }
 
     // Clean up
+    if (rebuild.valid())
+        rebuild.wait();
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
-    glDeleteVertexArrays(1, &skyboxVAO);
-    glDeleteBuffers(1, &skyboxVBO);
     glDeleteVertexArrays(1, &rayVAO);
+    glDeleteBuffers(1, &rayVBO);
     glDeleteBuffers(1, &rayEBO);
+    glDeleteTextures(1, &deflectionTexture);
+    glDeleteTextures(1, &bakedTexture);
+    glDeleteFramebuffers(2, geometryFBOs);
+    glDeleteRenderbuffers(2, geometryRenderbuffers);
+    glDeleteFramebuffers(1, &layersFBO);
+    glDeleteBuffers(1, &frameUBO);
+    shaders.Clear();
+    glDeleteTextures(2, geometryTextures);
+    glDeleteTextures(1, &layersTexture);
+    skyboxStream.reset();
+    atlas.reset();
+    resolution.reset();
+    glDeleteTextures(1, &cubemapTexture);
 
     glfwTerminate();
     return 0;
@@ -359,24 +691,104 @@ int main()
 // -Y (bottom)
 // +Z (front) 
 // -Z (back)
-GLuint loadCubemap(vector<const GLchar*> faces)
+// The PNG decode dominates startup, so with a pool the faces are decoded and mipmapped in
+// parallel and every face is uploaded (and freed) on this thread as soon as it is done
+GLuint loadCubemap(vector<const GLchar*> faces, ThreadPool* pool)
 {
     GLuint textureID;
     glGenTextures(1, &textureID);
     glActiveTexture(GL_TEXTURE0);
 
-    int width, height;
-    unsigned char* image;
+    vector<int> width(faces.size()), height(faces.size());
+    vector<unsigned char*> images(faces.size());
+    vector<vector<unsigned char>> mips(faces.size());
+    auto decode = [&](int i) {
+        images[i] = SOIL_load_image(faces[i], &width[i], &height[i], 0, SOIL_LOAD_RGB);
+        if (images[i])
+            mips[i] = MipChain(images[i], width[i], height[i]);
+    };
 
     glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-    for (GLuint i = 0; i < faces.size(); i++)
+    auto upload = [&](int i) {
+        if (!images[i]) {
+            cout << "ERROR::CUBEMAP::FACE_NOT_LOADED " << faces[i] << endl;
+            return;
+        }
+        UploadMipChain(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, width[i], height[i], images[i], mips[i].empty() ? images[i] : &mips[i][0]);
+        SOIL_free_image_data(images[i]);
+        vector<unsigned char>().swap(mips[i]);
+    };
+    if (pool)
+        pool->ParallelFor((int)faces.size(), decode, upload);
+    else {
+        for (GLuint i = 0; i < faces.size(); i++)
+        {
+            decode(i);
+            upload(i);
+        }
+    }
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    return textureID;
+}
+
+// Loads a DXT1 cubemap written by Cubemap::SaveDDS with all of its mip levels. Returns 0 if
+// there is no such file or the driver cannot sample S3TC textures.
+// SOIL_FLAG_DDS_LOAD_DIRECT is no use here: SOIL looks for S3TC and cube maps in
+// glGetString(GL_EXTENSIONS), which a core profile context does not answer.
+GLuint loadCubemapDDS(const GLchar* path)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+        return 0;
+    DDS_header header;
+    file.read((char*)&header, sizeof(header));
+    if (!file || header.dwMagic != (('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24))
+        || header.sPixelFormat.dwFourCC != (('D' << 0) | ('X' << 8) | ('T' << 16) | ('1' << 24))
+        || !(header.sCaps.dwCaps2 & DDSCAPS2_CUBEMAP) || header.dwWidth != header.dwHeight) {
+        cout << "ERROR::CUBEMAP::DDS_NOT_SUPPORTED " << path << endl;
+        return 0;
+    }
+
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &formatCount);
+    vector<GLint> formats(glm::max(formatCount, 1));
+    glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, &formats[0]);
+    if (find(formats.begin(), formats.begin() + formatCount, GL_COMPRESSED_RGB_S3TC_DXT1_EXT) == formats.begin() + formatCount)
+        return 0;
+
+    GLint levels = glm::max((GLint)header.dwMipMapCount, 1);
+    vector<char> blocks;
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+    for (GLuint i = 0; i < 6; i++)
     {
-        image = SOIL_load_image(faces[i], &width, &height, 0, SOIL_LOAD_RGB);
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0,
-            GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+        for (GLint level = 0; level < levels; level++)
+        {
+            GLsizei size = glm::max((GLsizei)header.dwWidth >> level, 1);
+            blocks.resize(((size + 3) / 4) * ((size + 3) / 4) * 8);
+            file.read(&blocks[0], blocks.size());
+            if (!file) {
+                cout << "ERROR::CUBEMAP::DDS_NOT_SUCCESFULLY_READ " << path << endl;
+                glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+                glDeleteTextures(1, &textureID);
+                return 0;
+            }
+            glCompressedTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level,
+                GL_COMPRESSED_RGB_S3TC_DXT1_EXT, size, size, 0, (GLsizei)blocks.size(), &blocks[0]);
+        }
     }
+    // Same filtering as loadCubemap
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -385,6 +797,117 @@ GLuint loadCubemap(vector<const GLchar*> faces)
     return textureID;
 }
 
+// Uploads a DeflectionTable as a 2D RG float texture, one row per observer radius:
+// deflection angle in R, capture mask in G
+GLuint loadDeflectionTable(const DeflectionTable& table)
+{
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, table.Size, table.Rows, 0, GL_RG, GL_FLOAT, &table.Texels[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return textureID;
+}
+
+// Replaces the texels of a texture made by loadDeflectionTable, the table size must not change
+void updateDeflectionTable(GLuint textureID, const DeflectionTable& table)
+{
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, table.Size, table.Rows, GL_RG, GL_FLOAT, &table.Texels[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Creates the G-buffer of the lensing pass: a framebuffer with one RGBA float texture that
+// holds the escaped world space direction (RGB) and its footprint (A, 0 if captured) of every
+// pixel's ray, and a depth/stencil renderbuffer for the shadow proxy
+GLuint createGeometryBuffer(GLuint width, GLuint height, GLuint& textureID, GLuint& renderbufferID)
+{
+    GLuint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureID, 0);
+
+    glGenRenderbuffers(1, &renderbufferID);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbufferID);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbufferID);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "ERROR::FRAMEBUFFER::NOT_COMPLETE" << endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    return framebuffer;
+}
+
+// Creates the layers of jittered samples of the still image: a framebuffer with an array texture
+// of layers G-buffer sized layers, RGBA half floats that hold a sample's escaped direction less
+// the G-buffer's (RGB) and its footprint (A, 0 if captured). Layer 0 is attached, the
+// refinement pass attaches the one it traces.
+GLuint createSampleLayers(GLuint width, GLuint height, GLuint layers, GLuint& textureID)
+{
+    GLuint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA16F, width, height, layers, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textureID, 0, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "ERROR::FRAMEBUFFER::NOT_COMPLETE" << endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    return framebuffer;
+}
+
+// The ray tracking shader compiled for an integrator (see the INTEGRATOR define of blackhole.frag),
+// with the passes that refine the still image if refinement is set
+Shader& rayTrackingPermutation(ShaderCache& shaders, Integrator method, bool refinement)
+{
+    map<string, string> defines;
+    if (refinement)
+        defines["REFINEMENT"] = "1";
+    if (method == SPHERE_TRACE)
+        defines["INTEGRATOR"] = "SPHERE_TRACE";
+    else if (method == LOOKUP_TABLE)
+        defines["INTEGRATOR"] = "LOOKUP_TABLE";
+    else
+        defines["INTEGRATOR"] = "DORMAND_PRINCE";
+    return shaders.Get("blackhole.vs", "blackhole.frag", defines);
+}
+
+// Points the samplers of a ray tracking permutation at their texture units and binds its Frame
+// uniform block, everything that changes per frame goes into that block
+void setupRayTrackingPermutation(Shader& permutation)
+{
+    permutation.Use();
+    glUniform1i(permutation.Uniform("skybox"), 0);
+    glUniform1i(permutation.Uniform("deflectionTable"), 1);
+    glUniform1i(permutation.Uniform("geometryBuffer"), 2);
+    glUniform1i(permutation.Uniform("previousGeometry"), 3);
+    glUniform1i(permutation.Uniform("sampleAtlas"), 4);
+    glUniform1i(permutation.Uniform("samplePixels"), 5);
+    glUniform1i(permutation.Uniform("sampleIndex"), 6);
+    glUniform1i(permutation.Uniform("sampleLayers"), 7);
+    permutation.BindUniformBlock("Frame", 0);
+}
+
 #pragma region "User input"
 
 // Moves/alters the camera positions based on user input
@@ -407,6 +930,13 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GL_TRUE);
 
+    if (key == GLFW_KEY_1 && action == GLFW_PRESS)
+        integrator = LOOKUP_TABLE;
+    if (key == GLFW_KEY_2 && action == GLFW_PRESS)
+        integrator = DORMAND_PRINCE;
+    if (key == GLFW_KEY_3 && action == GLFW_PRESS)
+        integrator = SPHERE_TRACE;
+
     if (action == GLFW_PRESS)
         keys[key] = true;
     else if (action == GLFW_RELEASE)
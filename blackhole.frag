@@ -1,7 +1,27 @@
 #version 330 core
+// blackhole.cpp compiles permutations of this shader with some of these defined beforehand
+#define SPHERE_TRACE 0
+#define DORMAND_PRINCE 1
+#define LOOKUP_TABLE 2
+#ifndef INTEGRATOR
+#define INTEGRATOR LOOKUP_TABLE // how Trace() follows a ray
+#endif
+// REFINEMENT: also the passes that refine the still image (lensingPass 3 to 5) and the shading
+// of their samples, only compiled once the camera first holds still
+#ifndef Max_Steps
 #define Max_Steps 100    // 
+#endif
+#ifndef Max_Dist
 #define Max_Dist 100.	 // 
+#endif
+#ifndef Surf_Dist
 #define Surf_Dist 0.01   //
+#endif
+#ifndef Max_Geodesic_Steps
+#define Max_Geodesic_Steps 300
+#endif
+#define Critical_B 2.5980762 // 3 sqrt(3) / 2, impact parameter of the photon sphere in rs
+//#define Far_Field 30.      // impact parameter in rs above which the weak-field deflection is used
 
 in vec2 screenCoord;
 
@@ -13,22 +33,78 @@ struct Camera {// 
     vec3 vertical; // ֱ
     vec3 origin; 
 };
-uniform Camera camera;
-uniform mat4 view;
+// per-frame uniforms, uploaded by blackhole.cpp in one buffer update (FrameUniforms there)
+layout(std140) uniform Frame {
+    Camera camera;
+    mat4 inverseView; // view space to world space
+    mat4 skyRotation; // rotation of the skybox at this frame's time
+    vec3 holeCenter; // view space position of the hole
+};
 uniform mat4 rotate;
 uniform samplerCube skybox;
-uniform float time;
+uniform float tolerance; // RK45 error tolerance
+uniform sampler2D deflectionTable; // R: deflection angle, G: captured, see DeflectionTable.h
+uniform float deflectionRow; // texture coordinate of the camera's radius across the table rows
+uniform int lensingPass; // 0: trace and shade, 1: geometry pass into the G-buffer, 2: shade the G-buffer, 3: TraceLayer(), 4: trace sampleAtlas, 5: SampleNeed()
+uniform sampler2D geometryBuffer; // RGB: escaped world space direction, A: its footprint (see Footprint()), 0 captured
+uniform vec2 geometryScale; // size of the traced part of the G-buffer relative to the screen
+#ifndef Edge_Footprints
+#define Edge_Footprints 2.   // neighbouring G-buffer texels further apart than this many footprints are not interpolated
+#endif
+// the last G-buffer and its camera, the geometry pass reuses its texels where they still hold
+uniform bool reprojecting;
+uniform sampler2D previousGeometry;
+uniform vec2 previousScale; // size of its traced part relative to the screen
+uniform mat3 previousView; // world space to its camera's view space
+uniform vec4 previousFrustum; // its camera's lower left corner (xy) and size (zw) on the z = -1 plane
+uniform float previousShift; // distance its camera is from this frame's, over the distance to the hole
+uniform int refreshTile; // counts the geometry passes, tiles with index refreshTile % Refresh_Frames are traced anyway
+#ifndef Reprojection_Error
+#define Reprojection_Error 0.25 // footprints a reused direction may be off by
+#endif
+#ifndef Refresh_Tile
+#define Refresh_Tile 16
+#endif
+#ifndef Refresh_Frames
+#define Refresh_Frames 8     // every texel is traced again at least this often
+#endif
+#ifndef Shadow_Margin
+#define Shadow_Margin 2.     // reused texels closer than this many texels to the shadow's edge are traced
+#endif
+#ifdef REFINEMENT
+// extra samples of the still image's pixels beyond the layers' (see SampleAtlas.h), only
+// traced and shaded while the camera holds still
+uniform sampler2D sampleAtlas; // G-buffer texel of every sample
+uniform usampler2D samplePixels; // per atlas texel: pixel (xy), its index among the pixel's samples (z), their number (w, 0 unused)
+uniform usampler2D sampleIndex; // per pixel: first atlas texel and number of extra samples
+uniform int refinedSamples; // atlas texels traced so far, -1 until they are laid out
+#ifndef Max_Samples
+#define Max_Samples 64
+#endif
+#ifndef Min_Anisotropy
+#define Min_Anisotropy 4.    // squared stretch of the lens map across a pixel below which one sample is enough
+#endif
+#ifndef Sample_Divergence
+#define Sample_Divergence 0.5 // spread of a pixel's samples, in footprints, that a lens map linear across the pixel stays below
+#endif
+// jittered samples of every pixel of the still image, see ShadeSamples()
+uniform sampler2DArray sampleLayers; // RGB: escaped direction less the G-buffer's, A: footprint, 0 captured
+uniform int refinedLayers; // layers traced so far, 0 while the camera moves and the G-buffer is shaded instead
+uniform int sampleLayer; // the layer this pass traces
+#endif
 
 // 
 struct Ray{
     vec3 origin;
     vec3 direction;
+    mat2x3 differential; // derivatives of direction to the next pixel along screen x and y
 };
 
 Ray CreateRay(vec3 o, vec3 d){
     Ray ray;
     ray.origin = o;
     ray.direction = d;
+    ray.differential = mat2x3(0.);
 
     return ray;
 };
@@ -64,34 +140,149 @@ bool SphereHit(Sphere sphere, Ray ray){
 	return delta > 0.0;
 }
 
-vec3 rotateVec3(vec3 v, vec3 axis, float theta){
-    vec4 v1 = vec4(v, 1.0);
-    float c = cos(theta),
-        s = sin(theta), 
-        p = 1 - cos(theta);
-    vec3 a = axis;
-    mat4 rotate = mat4(  // ת
-        c+pow(a.x, 2)*p, a.x*a.y*p-a.z*s, a.x*a.z*p+a.y*s, 0,
-        a.y*a.x*p+a.z*s, c+pow(a.y,2)*p, a.y*a.z*p-a.x*s, 0,
-        a.z*a.x*p-a.y*s, a.z*a.y*p+a.x*s ,c+pow(a.z,2)*p, 0,
-        0, 0, 0, 1
-    );
+// derivatives of normalize(d) for derivatives D of d
+mat2x3 NormalizeDifferential(vec3 d, mat2x3 D)
+{
+    vec3 n = normalize(d);
+    return mat2x3(D[0] - dot(D[0], n) * n, D[1] - dot(D[1], n) * n) / length(d);
+}
+
+// angle in radians the escaped direction turns across a pixel, from the derivatives D of the
+// unit direction. Never 0, the traced functions return 0 for a captured ray.
+float Footprint(mat2x3 D)
+{
+    return max(max(length(D[0]), length(D[1])), 1e-7);
+}
+
+// skybox mip level for a pixel that sees footprint radians of sky. The implicit level of
+// texture() would come from the screen space derivatives of the escaped direction, which are
+// meaningless next to the shadow and at cube face seams of the G-buffer.
+float SkyLod(float footprint)
+{
+    // a texel in the middle of a face covers 2 / size radians
+    float texels = footprint * float(textureSize(skybox, 0).x) * 0.5;
+    return log2(max(texels, 1.));
+}
+
+// skybox color seen along a unit world space direction
+vec3 SampleSky(vec3 worldDir, float lod)
+{
+    return vec3(textureLod(skybox, mat3(skyRotation) * worldDir, lod));
+}
+
+// shading pass: only the skybox rotation depends on time, the escaped directions of the
+// geometry pass stay valid as long as the camera does not move
+vec3 ShadeGeometry(vec4 geometry)
+{
+    if(geometry.a <= 0.) {
+        return vec3(0.);
+    }
+    return SampleSky(geometry.xyz, SkyLod(geometry.a));
+}
+
+#ifdef REFINEMENT
+// samples the still image takes of a pixel, from the full resolution G-buffer and the layers'
+// samples of it. The skybox mip level filters the sky over the footprint, a square, but the
+// lens map stretches a pixel into a long ellipse along the photon ring and the Einstein ring,
+// and across the shadow edge half of it is black. One mip level then blurs the ellipse's short
+// axis or aliases its long one, n samples resolve sqrt(n) times finer. The stretch comes from
+// the Jacobian of the escaped direction (central differences of the neighbours): its squared
+// axis ratio is the sample count that resolves the short axis with square sample cells. Where
+// the lens map folds inside the pixel the Jacobian says little, but the layers' directions
+// spread further than Sample_Divergence footprints, and the squared ratio is the count that
+// brings each sample's share of the spread back under it. Only the escaped directions go in,
+// so the need holds while the sky rotates.
+float SampleNeed(ivec2 pixel)
+{
+    ivec2 last = textureSize(geometryBuffer, 0) - 1;
+    vec4 center = texelFetch(geometryBuffer, pixel, 0);
+    bool captured = center.a <= 0.;
+    vec4 texels[4];
+    for(int i = 0; i < 4; i++) {
+        ivec2 offset = i < 2 ? ivec2(2 * i - 1, 0) : ivec2(0, 2 * i - 5);
+        texels[i] = texelFetch(geometryBuffer, clamp(pixel + offset, ivec2(0), last), 0);
+        if((texels[i].a <= 0.) != captured) {
+            return float(Max_Samples);
+        }
+    }
+    // the layers store the samples' offsets from the G-buffer's direction
+    vec3 mean = vec3(0.);
+    float square = 0.;
+    for(int i = 0; i < refinedLayers; i++) {
+        vec4 texel = texelFetch(sampleLayers, ivec3(pixel, i), 0);
+        if((texel.a <= 0.) != captured) {
+            return float(Max_Samples);
+        }
+        mean += texel.xyz;
+        square += dot(texel.xyz, texel.xyz);
+    }
+    if(captured) {
+        return 1.;
+    }
+    float layers = float(max(refinedLayers, 1));
+    mean /= layers;
+    float spread = sqrt(max(square / layers - dot(mean, mean), 0.));
+    float divergence = spread / (Sample_Divergence * center.a);
 
-    return vec3(rotate * v1);
+    vec3 dx = 0.5 * (texels[1].xyz - texels[0].xyz);
+    vec3 dy = 0.5 * (texels[3].xyz - texels[2].xyz);
+    float xx = dot(dx, dx), yy = dot(dy, dy), xy = dot(dx, dy);
+    float root = sqrt(max((xx - yy) * (xx - yy) + 4. * xy * xy, 0.));
+    float anisotropy = (xx + yy + root) / max(xx + yy - root, 1e-20);
+    float need = max(anisotropy < Min_Anisotropy ? 1. : anisotropy, divergence * divergence);
+    return min(ceil(need), float(Max_Samples));
+}
+
+// color of a pixel of the still image: the mean of the skies of its samples in the first
+// refinedLayers layers and of its extra samples in the atlas (index from sampleIndex) traced so
+// far, each filtered over its share of the footprint. Averaging the colors, not the
+// directions, keeps the parts of the sky a pixel straddles apart where the lens map folds.
+vec3 ShadeSamples(ivec2 pixel, uvec2 index)
+{
+    uint traced = uint(max(refinedSamples, 0));
+    traced = traced > index.x ? min(traced - index.x, index.y) : 0u;
+    float samples = float(refinedLayers) + float(traced);
+    float share = inversesqrt(samples);
+
+    vec4 center = texelFetch(geometryBuffer, pixel, 0);
+    vec3 origin = center.a > 0. ? center.xyz : vec3(0.);
+    vec3 color = vec3(0.);
+    for(int i = 0; i < refinedLayers; i++) {
+        vec4 texel = texelFetch(sampleLayers, ivec3(pixel, i), 0);
+        if(texel.a > 0.) {
+            color += SampleSky(normalize(origin + texel.xyz), SkyLod(texel.a * share));
+        }
+    }
+    uint width = uint(textureSize(sampleAtlas, 0).x);
+    for(uint i = 0u; i < traced; i++) {
+        uint texel = index.x + i;
+        vec4 geometry = texelFetch(sampleAtlas, ivec2(texel % width, texel / width), 0);
+        color += ShadeGeometry(vec4(geometry.xyz, geometry.a * share));
+    }
+    return color / samples;
+}
+#endif
+
+// black hole around holeCenter, radius is the Schwarzschild radius
+Sphere BlackHole()
+{
+    return CreateSphere(holeCenter, 0.1);
 }
 
 float GetDist(vec3 p)
 {
-    Sphere s = CreateSphere(vec3(0, 0, -6), 0.1);
+    Sphere s = BlackHole();
 
     float d = length(p-s.center)-s.radius;// P㵽ľ
     
     return d;
 }
 
-vec3 RayMarch(Ray ray)
+// the traced functions below return the escaped view space direction and, in w, its footprint
+// from the ray differentials followed along the path. w is 0 if the ray is captured
+vec4 RayMarch(Ray ray)
 {
-    vec3 color = vec3(0.);
+    vec4 color = vec4(0.);
     float d0 = 0.;
     for(int i = 0; i < Max_Steps; i++)
     {
@@ -100,10 +291,7 @@ vec3 RayMarch(Ray ray)
         d0 += ds;
         if(d0 > Max_Dist) {
             // sample skybox
-            vec3 worldDir = vec3(inverse(view) * vec4(ray.direction, 1.0));
-            vec3 normalizeDir = normalize(worldDir.xyz);
-            normalizeDir = rotateVec3(normalizeDir, vec3(0, 1, 0), time);
-            color = vec3(texture(skybox, normalizeDir));
+            color = vec4(ray.direction, Footprint(NormalizeDifferential(ray.direction, ray.differential)));
             break;
         } 
         if(d0 < Surf_Dist) {
@@ -114,29 +302,425 @@ vec3 RayMarch(Ray ray)
     return color;     
 }
 
+// photon acceleration: with h = |x cross v| conserved, a Schwarzschild null geodesic
+// follows x'' = -3/2 rs h^2 x / r^5 in flat coordinates around the hole
+vec3 GeodesicAccel(vec3 x, float h2)
+{
+    float r2 = dot(x, x);
+    return -1.5 * BlackHole().radius * h2 * x / (r2 * r2 * sqrt(r2));
+}
+
+// derivatives of GeodesicAccel(x, h2) for derivatives X of x and H2 of h2
+mat2x3 GeodesicAccelDifferential(vec3 x, mat2x3 X, float h2, vec2 H2)
+{
+    float r2 = dot(x, x);
+    float k = -1.5 * BlackHole().radius / (r2 * r2 * sqrt(r2));
+    return mat2x3(k * ((H2[0] - 5. * h2 * dot(x, X[0]) / r2) * x + h2 * X[0]),
+                  k * ((H2[1] - 5. * h2 * dot(x, X[1]) / r2) * x + h2 * X[1]));
+}
+
+// deflection of a ray with impact parameter b starting at angle psi to the hole, second
+// order in rs / b (error about 5 (rs / b)^3)
+float WeakFieldDeflection(float b, float psi)
+{
+    float q = BlackHole().radius / b;
+    float c = cos(psi);
+    return 0.5 * q * (2. + 3. * c - c * c * c)
+        + q * q * (120. * (3.14159265 - psi) - 48. * sin(psi) + 69. * sin(2. * psi)
+            + 16. * sin(3. * psi) - 6. * sin(4. * psi) + sin(6. * psi)) / 128.;
+}
+
+// Dormand-Prince 5(4) steps with per-ray error control instead of Max_Steps fixed steps:
+// nearly straight rays far from the hole take a few long steps, bent rays many short ones.
+// The ray differentials (X, V) take the same steps through the linearized equation.
+vec4 RayMarchRK45(Ray ray)
+{
+    vec3 x = ray.origin - BlackHole().center;
+    vec3 v = normalize(ray.direction);
+    float h2 = dot(cross(x, v), cross(x, v));
+    mat2x3 X = mat2x3(0.);
+    mat2x3 V = NormalizeDifferential(ray.direction, ray.differential);
+    vec2 H2 = 2. * vec2(dot(cross(x, v), cross(x, V[0])), dot(cross(x, v), cross(x, V[1])));
+
+    // the impact parameter alone decides the shadow and the far field
+    float r0 = length(x);
+    float b = sqrt(h2);
+    if(b < Critical_B * BlackHole().radius && dot(x, v) < 0. && r0 > 1.5 * BlackHole().radius) {
+        return vec4(0.);
+    }
+#ifdef Far_Field
+    if(b > Far_Field * BlackHole().radius) {
+        vec3 e1 = -x / r0;
+        vec3 e2 = (v - dot(v, e1) * e1) / (b / r0);
+        float psi = atan(b / r0, dot(v, e1));
+        float phi = psi - WeakFieldDeflection(b, psi);
+        // the deflection hardly changes across a pixel out here, the footprint is the camera's
+        return vec4(cos(phi) * e1 + sin(phi) * e2, Footprint(V));
+    }
+#endif
+    float h = 0.1 * length(x);
+    vec3 a1 = GeodesicAccel(x, h2);
+    mat2x3 A1 = GeodesicAccelDifferential(x, X, h2, H2);
+
+    for(int i = 0; i < Max_Geodesic_Steps; i++)
+    {
+        float r = length(x);
+        if(r < BlackHole().radius) {
+            break;
+        }
+        if(r > Max_Dist && dot(x, v) > 0.) {
+            return vec4(v, Footprint(NormalizeDifferential(v, V)));
+        }
+        h = min(h, r);
+
+        vec3 v2 = v + h * (1./5. * a1);
+        vec3 a2 = GeodesicAccel(x + h * (1./5. * v), h2);
+        vec3 v3 = v + h * (3./40. * a1 + 9./40. * a2);
+        vec3 a3 = GeodesicAccel(x + h * (3./40. * v + 9./40. * v2), h2);
+        vec3 v4 = v + h * (44./45. * a1 - 56./15. * a2 + 32./9. * a3);
+        vec3 a4 = GeodesicAccel(x + h * (44./45. * v - 56./15. * v2 + 32./9. * v3), h2);
+        vec3 v5 = v + h * (19372./6561. * a1 - 25360./2187. * a2 + 64448./6561. * a3 - 212./729. * a4);
+        vec3 a5 = GeodesicAccel(x + h * (19372./6561. * v - 25360./2187. * v2 + 64448./6561. * v3 - 212./729. * v4), h2);
+        vec3 v6 = v + h * (9017./3168. * a1 - 355./33. * a2 + 46732./5247. * a3 + 49./176. * a4 - 5103./18656. * a5);
+        vec3 a6 = GeodesicAccel(x + h * (9017./3168. * v - 355./33. * v2 + 46732./5247. * v3 + 49./176. * v4 - 5103./18656. * v5), h2);
+        // 5th order solution, its derivative is the first stage of the next step
+        vec3 xn = x + h * (35./384. * v + 500./1113. * v3 + 125./192. * v4 - 2187./6784. * v5 + 11./84. * v6);
+        vec3 vn = v + h * (35./384. * a1 + 500./1113. * a3 + 125./192. * a4 - 2187./6784. * a5 + 11./84. * a6);
+        vec3 a7 = GeodesicAccel(xn, h2);
+
+        // difference to the embedded 4th order solution
+        vec3 ex = h * (71./57600. * v - 71./16695. * v3 + 71./1920. * v4 - 17253./339200. * v5 + 22./525. * v6 - 1./40. * vn);
+        vec3 ev = h * (71./57600. * a1 - 71./16695. * a3 + 71./1920. * a4 - 17253./339200. * a5 + 22./525. * a6 - 1./40. * a7);
+        float err = max(length(ex) / (1. + r), length(ev)) / tolerance;
+        float scale = 0.9 * pow(max(err, 1e-10), -0.2);
+        if(err > 1.) {
+            h *= max(scale, 0.2);
+            continue;
+        }
+
+        // same stages for the differentials, only for accepted steps
+        mat2x3 V2 = V + h * (1./5. * A1);
+        mat2x3 A2 = GeodesicAccelDifferential(x + h * (1./5. * v), X + h * (1./5. * V), h2, H2);
+        mat2x3 V3 = V + h * (3./40. * A1 + 9./40. * A2);
+        mat2x3 A3 = GeodesicAccelDifferential(x + h * (3./40. * v + 9./40. * v2), X + h * (3./40. * V + 9./40. * V2), h2, H2);
+        mat2x3 V4 = V + h * (44./45. * A1 - 56./15. * A2 + 32./9. * A3);
+        mat2x3 A4 = GeodesicAccelDifferential(x + h * (44./45. * v - 56./15. * v2 + 32./9. * v3), X + h * (44./45. * V - 56./15. * V2 + 32./9. * V3), h2, H2);
+        mat2x3 V5 = V + h * (19372./6561. * A1 - 25360./2187. * A2 + 64448./6561. * A3 - 212./729. * A4);
+        mat2x3 A5 = GeodesicAccelDifferential(x + h * (19372./6561. * v - 25360./2187. * v2 + 64448./6561. * v3 - 212./729. * v4), X + h * (19372./6561. * V - 25360./2187. * V2 + 64448./6561. * V3 - 212./729. * V4), h2, H2);
+        mat2x3 V6 = V + h * (9017./3168. * A1 - 355./33. * A2 + 46732./5247. * A3 + 49./176. * A4 - 5103./18656. * A5);
+        mat2x3 A6 = GeodesicAccelDifferential(x + h * (9017./3168. * v - 355./33. * v2 + 46732./5247. * v3 + 49./176. * v4 - 5103./18656. * v5), X + h * (9017./3168. * V - 355./33. * V2 + 46732./5247. * V3 + 49./176. * V4 - 5103./18656. * V5), h2, H2);
+        X = X + h * (35./384. * V + 500./1113. * V3 + 125./192. * V4 - 2187./6784. * V5 + 11./84. * V6);
+        V = V + h * (35./384. * A1 + 500./1113. * A3 + 125./192. * A4 - 2187./6784. * A5 + 11./84. * A6);
+        A1 = GeodesicAccelDifferential(xn, X, h2, H2);
+
+        h *= min(scale, 5.);
+        x = xn;
+        v = vn;
+        a1 = a7;
+    }
+
+    return vec4(0.);
+}
+
+// one fetch instead of the integration: the final direction of a ray only depends on its
+// angle psi to the hole, the table stores how far it turns in the plane through the hole
+vec4 RayLookup(Ray ray)
+{
+    vec3 e1 = normalize(BlackHole().center - ray.origin);
+    vec3 d = normalize(ray.direction);
+    float c = dot(d, e1);
+    vec3 perp = d - c * e1;
+    float s = length(perp);
+    float psi = atan(s, c);
+    float column = sqrt(psi / 3.14159265);
+    vec2 entry = texture(deflectionTable, vec2(column, deflectionRow)).rg;
+    if(entry.g > 0.5) {
+        return vec4(0.);
+    }
+
+    vec3 e2 = s > 0. ? perp / s : vec3(0.);
+    float phi = psi + entry.r;
+
+    // differentials: psi and the plane (e2) turn with d, the deflection's slope comes from
+    // the neighbouring columns (the center one stands in for a captured neighbour)
+    float texel = 1. / float(textureSize(deflectionTable, 0).x);
+    float column0 = max(column - texel, 0.);
+    float column1 = min(column + texel, 1.);
+    vec2 entry0 = texture(deflectionTable, vec2(column0, deflectionRow)).rg;
+    vec2 entry1 = texture(deflectionTable, vec2(column1, deflectionRow)).rg;
+    if(entry0.g > 0.5) {
+        entry0 = entry;
+        column0 = column;
+    }
+    if(entry1.g > 0.5) {
+        entry1 = entry;
+        column1 = column;
+    }
+    float slope = column1 > column0 ? (entry1.r - entry0.r) / (3.14159265 * (column1 * column1 - column0 * column0)) : 0.;
+    mat2x3 D = NormalizeDifferential(ray.direction, ray.differential);
+    mat2x3 outgoing = mat2x3(0.);
+    if(s > 1e-6) {
+        for(int i = 0; i < 2; i++) {
+            float dc = dot(D[i], e1);
+            float dpsi = -dc / s;
+            vec3 de2 = (D[i] - dc * e1 - c * dpsi * e2) / s;
+            outgoing[i] = (-sin(phi) * e1 + cos(phi) * e2) * dpsi * (1. + slope) + sin(phi) * de2;
+        }
+    }
+    return vec4(cos(phi) * e1 + sin(phi) * e2, Footprint(outgoing));
+}
+
+// follows the ray with the integrator this permutation was compiled for
+vec4 Trace(Ray ray)
+{
+#if INTEGRATOR == SPHERE_TRACE
+    return RayMarch(ray);
+#elif INTEGRATOR == DORMAND_PRINCE
+    return RayMarchRK45(ray);
+#else
+    return RayLookup(ray);
+#endif
+}
+
+vec3 Shade(vec4 traced)
+{
+    if(traced.w <= 0.) {
+        return vec3(0.);
+    }
+    return SampleSky(normalize(mat3(inverseView) * traced.xyz), SkyLod(traced.w));
+}
+
 vec3 RayTrace(Ray ray){
     vec3 color = vec3(0.0);
     float alpha = 1.0;
      
-    Sphere s = CreateSphere(vec3(0, 0, -6), 0.1);
+    Sphere s = BlackHole();
     if (SphereHit(s, ray)){
         return color;
     }
     
     // skybox color
-    vec3 worldDir = vec3(inverse(view) * vec4(ray.direction, 1.0));
-    vec3 normalizeDir = normalize(worldDir.xyz);
-    normalizeDir = rotateVec3(normalizeDir, vec3(0, 1, 0), time);
-    color = vec3(texture(skybox, normalizeDir));
+    color = SampleSky(normalize(mat3(inverseView) * ray.direction), 0.);
     return color;
 }
 
+// G-buffer texel of a ray: the escaped direction in world space and its footprint
+vec4 TraceGeometry(Ray ray)
+{
+    vec4 lensed = Trace(ray);
+    if(lensed.w > 0.) {
+        lensed.xyz = normalize(mat3(inverseView) * lensed.xyz);
+    }
+    return lensed;
+}
+
+// G-buffer texel at position (in texels) of a G-buffer whose traced part has size texels.
+// Joint bilateral interpolation: the four nearest texels are interpolated with bilinear
+// weights, each also weighted by how close its direction is to the nearest texel's. Where they
+// do not agree on the capture or are more than Edge_Footprints apart, interpolating would blur
+// the shadow edge or smear the photon ring, so w is -1 and the ray has to be traced instead.
+vec4 InterpolateGeometry(sampler2D gbuffer, vec2 position, ivec2 size)
+{
+    ivec2 last = size - 1;
+    vec2 p = position - 0.5;
+    ivec2 base = ivec2(floor(p));
+    vec2 f = p - vec2(base);
+    vec4 texels[4];
+    float weights[4];
+    for(int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        texels[i] = texelFetch(gbuffer, clamp(base + offset, ivec2(0), last), 0);
+        weights[i] = (offset.x == 1 ? f.x : 1. - f.x) * (offset.y == 1 ? f.y : 1. - f.y);
+    }
+    vec4 nearest = texels[(f.x < 0.5 ? 0 : 1) + (f.y < 0.5 ? 0 : 2)];
+    bool captured = nearest.a <= 0.;
+    float edge = 0.;
+    for(int i = 0; i < 4; i++) {
+        edge = max(edge, texels[i].a);
+    }
+    edge *= Edge_Footprints;
+
+    vec3 direction = vec3(0.);
+    float footprint = 0.;
+    float sum = 0.;
+    for(int i = 0; i < 4; i++) {
+        if((texels[i].a <= 0.) != captured) {
+            return vec4(0., 0., 0., -1.);
+        }
+        if(captured) {
+            continue;
+        }
+        float angle = acos(clamp(dot(texels[i].xyz, nearest.xyz), -1., 1.));
+        if(angle > edge) {
+            return vec4(0., 0., 0., -1.);
+        }
+        float weight = weights[i] * exp(-2. * (angle / edge) * (angle / edge));
+        direction += weight * texels[i].xyz;
+        footprint += weight * texels[i].a;
+        sum += weight;
+    }
+    if(captured) {
+        return vec4(0.);
+    }
+    return vec4(normalize(direction), footprint / sum);
+}
+
+// G-buffer texel of the screen pixel at fragCoord, upsampled from the G-buffer traced at
+// geometryScale. w is -1 where the pixel has to be traced, see InterpolateGeometry()
+vec4 UpsampleGeometry(vec2 fragCoord)
+{
+    if(geometryScale == vec2(1.)) {
+        return texelFetch(geometryBuffer, ivec2(fragCoord), 0);
+    }
+    ivec2 size = ivec2(vec2(textureSize(geometryBuffer, 0)) * geometryScale + 0.5);
+    vec4 geometry = InterpolateGeometry(geometryBuffer, fragCoord * geometryScale, size);
+    if(geometry.a > 0.) {
+        // a texel spans 1 / geometryScale screen pixels
+        geometry.a = max(geometry.a * geometryScale.x, 1e-7);
+    }
+    return geometry;
+}
+
+// angle to the hole's direction below which a ray from the camera is captured: the impact
+// parameter r sin(psi) below Critical_B (the hole's radius for straight sphere tracing).
+// -1 inside the photon sphere, where the shadow is not that cone.
+float ShadowAngle()
+{
+    float r = length(BlackHole().center);
+#if INTEGRATOR == SPHERE_TRACE
+    return asin(min(BlackHole().radius / r, 1.));
+#else
+    return r > 1.5 * BlackHole().radius ? asin(min(Critical_B * BlackHole().radius / r, 1.)) : -1.;
+#endif
+}
+
+// G-buffer texel of a ray taken from the previous G-buffer, w is -1 where it has to be traced.
+// Turning the camera moves the rays without changing where they escape to, so the texel is
+// looked up where the ray's direction was on the previous screen. Moving the camera by
+// previousShift turns an escaped direction by about |M - 1| previousShift, M being the
+// magnification footprint / pixel angle, which must stay below Reprojection_Error footprints.
+// That says nothing about captured texels: moving away from the hole shrinks the shadow, and
+// its edge moves by several texels a frame. So texels near this camera's edge (ShadowAngle()),
+// or captured on the wrong side of it, are traced too.
+// Errors add up over the frames a texel is reused, so every texel is traced again after
+// Refresh_Frames frames, whole tiles at a time so neighbouring pixels take the same branch.
+vec4 ReprojectGeometry(Ray ray, vec2 fragCoord)
+{
+    ivec2 tile = ivec2(fragCoord) / Refresh_Tile;
+    if(!reprojecting || (tile.x + 3 * tile.y) % Refresh_Frames == refreshTile % Refresh_Frames) {
+        return vec4(0., 0., 0., -1.);
+    }
+    vec3 direction = previousView * (mat3(inverseView) * ray.direction);
+    if(direction.z >= 0.) {
+        return vec4(0., 0., 0., -1.);
+    }
+    vec2 uv = (direction.xy / -direction.z - previousFrustum.xy) / previousFrustum.zw;
+    if(any(lessThan(uv, vec2(0.))) || any(greaterThan(uv, vec2(1.)))) {
+        return vec4(0., 0., 0., -1.);
+    }
+    ivec2 size = ivec2(vec2(textureSize(previousGeometry, 0)) * previousScale + 0.5);
+    vec4 geometry = InterpolateGeometry(previousGeometry, uv * vec2(size), size);
+    if(geometry.a < 0.) {
+        return geometry;
+    }
+    // the angle between the rays of this G-buffer's texels
+    float pixel = Footprint(NormalizeDifferential(ray.direction, ray.differential));
+    vec3 d = normalize(ray.direction);
+    vec3 e1 = normalize(BlackHole().center);
+    float psi = atan(length(cross(d, e1)), dot(d, e1));
+    float shadow = ShadowAngle();
+    if(shadow < 0. ? geometry.a <= 0. : abs(psi - shadow) < Shadow_Margin * pixel || (geometry.a <= 0.) != (psi < shadow)) {
+        return vec4(0., 0., 0., -1.);
+    }
+    if(geometry.a > 0.) {
+        // the footprint of a texel of this G-buffer
+        geometry.a *= previousScale.x / geometryScale.x;
+        if(abs(geometry.a / pixel - 1.) * previousShift > Reprojection_Error * geometry.a) {
+            return vec4(0., 0., 0., -1.);
+        }
+    }
+    return geometry;
+}
+
+#ifdef REFINEMENT
+// G-buffer texel of a ray through pixel at the offset of the R2 sequence with index n (0 is
+// the center), with the footprint of the whole pixel
+vec4 TraceJittered(ivec2 pixel, uint n)
+{
+    vec2 size = vec2(textureSize(geometryBuffer, 0));
+    vec2 offset = fract(0.5 + float(n) * vec2(0.7548777, 0.5698403)) - 0.5;
+    vec2 uv = (vec2(pixel) + 0.5 + offset) / size;
+    Ray ray = CreateRay(camera.origin, camera.lower_left_corner + uv.x * camera.horizontal + uv.y * camera.vertical - camera.origin);
+    ray.differential = mat2x3(camera.horizontal / size.x, camera.vertical / size.y);
+    return TraceGeometry(ray);
+}
+
+// G-buffer texel of an extra sample (a samplePixels texel), at the sample's offset of the R2
+// sequence in its pixel. Its index follows the layers', so the two never trace the same ray.
+vec4 TraceSample(uvec4 atlasTexel)
+{
+    if(atlasTexel.w == 0u) {
+        discard;
+    }
+    return TraceJittered(ivec2(atlasTexel.xy), atlasTexel.z);
+}
+
+// texel of layer sampleLayer: the pixel's sample with that index, stored as its difference to
+// the G-buffer's direction so that half floats keep it to a fraction of a skybox texel
+vec4 TraceLayer(ivec2 pixel)
+{
+    vec4 center = texelFetch(geometryBuffer, pixel, 0);
+    vec4 geometry = TraceJittered(pixel, uint(sampleLayer));
+    if(geometry.a <= 0.) {
+        return vec4(0.);
+    }
+    return vec4(geometry.xyz - (center.a > 0. ? center.xyz : vec3(0.)), geometry.a);
+}
+#endif
+
 void main(){
     float u = screenCoord.x;
     float v = screenCoord.y;
 
     Ray ray = CreateRay(camera.origin, camera.lower_left_corner + u * camera.horizontal + v * camera.vertical - camera.origin);
+    ray.differential = mat2x3(dFdx(u) * camera.horizontal, dFdy(v) * camera.vertical);
+
+    if(lensingPass == 2) {
+#ifdef REFINEMENT
+        if(refinedLayers > 0) {
+            ivec2 pixel = ivec2(gl_FragCoord.xy);
+            uvec2 index = refinedSamples >= 0 ? texelFetch(sampleIndex, pixel, 0).xy : uvec2(0u);
+            FragColor = vec4(ShadeSamples(pixel, index), 1.0);
+            return;
+        }
+#endif
+        vec4 geometry = UpsampleGeometry(gl_FragCoord.xy);
+        if(geometry.a < 0.) {
+            geometry = TraceGeometry(ray);
+        }
+        FragColor = vec4(ShadeGeometry(geometry), 1.0);
+        return;
+    }
     
     //FragColor = vec4(RayTrace(ray), 1.0);
-    FragColor = vec4(RayMarch(ray), 1.0);
+    if(lensingPass == 1) {
+        vec4 geometry = ReprojectGeometry(ray, gl_FragCoord.xy);
+        FragColor = geometry.a < 0. ? TraceGeometry(ray) : geometry;
+        return;
+    }
+#ifdef REFINEMENT
+    if(lensingPass == 3) {
+        FragColor = TraceLayer(ivec2(gl_FragCoord.xy));
+        return;
+    }
+    if(lensingPass == 4) {
+        FragColor = TraceSample(texelFetch(samplePixels, ivec2(gl_FragCoord.xy), 0));
+        return;
+    }
+    if(lensingPass == 5) {
+        FragColor = vec4(SampleNeed(ivec2(gl_FragCoord.xy)));
+        return;
+    }
+#endif
+    FragColor = vec4(Shade(Trace(ray)), 1.0);
 }
\ No newline at end of file
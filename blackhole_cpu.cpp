@@ -0,0 +1,323 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+
+// GLM
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// Other includes
+#include "Camera.h"
+#include "Cubemap.h"
+#include "CpuRenderer.h"
+#include "ThreadPool.h"
+
+// CPU reference renderer, no OpenGL context needed. Renders the frame blackhole.cpp would
+// show for the given time and camera angles and writes it to disk.
+//
+// Usage: blackhole_cpu [options] [output.bmp|.tga] [width] [height] [time] [yaw] [pitch] [skybox dir]
+//        blackhole_cpu --compare A B
+//
+// --compare prints how far image B is from image A (e.g. a frame of another renderer or of
+// other settings from this one's reference frame): the mean and the largest absolute
+// difference per channel in 8 bit steps, and the number of channels off by more than 8.
+//
+// Options:
+//   --packet       march SIMD ray packets instead of one ray at a time
+//   --position X Y Z
+//                  world space camera position (default 0 0 0, the hole is at 0 0 -6)
+//   --threads N    render tiles on N worker threads (default: one per hardware thread, 1 = no pool)
+//   --integrator march|fixed|rk45|table
+//                  straight sphere tracing, fixed-step or adaptive geodesics, or one lookup
+//                  per pixel in a deflection table (default rk45)
+//   --tolerance T  error tolerance of the rk45 integrator (default 1e-5)
+//   --step H       step length of the fixed integrator (default 0.05)
+//   --max-steps N  step limit per geodesic (default 300), the fixed integrator gets the steps
+//                  of the straight path out of the scene on top
+//   --far-field B  impact parameter in Schwarzschild radii above which rk45 uses the
+//                  weak-field deflection (default 0, every ray is integrated)
+//   --table-size N texels of the deflection table (default 4096)
+//   --tables FILE  look up in the deflection tables of FILE instead of tracing a table for
+//                  the camera's radius (if FILE covers it)
+//   --bake-tables FILE
+//                  trace deflection tables for --rows radii log-spaced over --radii, write
+//                  them to FILE (e.g. resources/deflection.bin) and exit without rendering
+//   --rows N       (default 256)
+//   --radii MIN MAX
+//                  (default 0.2 100, that is 2 to 1000 Schwarzschild radii)
+//   --coarse N     trace N x N pixel blocks from their corner and center rays and only trace
+//                  every pixel of the blocks along the shadow edge and the photon ring
+//                  (default 0, every pixel is traced)
+//   --coarse-tolerance A
+//                  angle in radians by which an interpolated block's center ray may miss
+//                  (default 1e-5)
+//   --frames N     render N frames of the skybox rotation, --frame-time seconds apart, to
+//                  output_000.bmp, output_001.bmp, ... The rays are traced once and every
+//                  frame only shades them (default 1)
+//   --frame-time S (default 1/30)
+//   --bake-skybox FILE
+//                  compress the skybox faces to a DXT1 cubemap with mipmaps, write it to FILE
+//                  (blackhole.cpp loads resources/skybox.dds) and exit without rendering
+
+// output.bmp -> output_007.bmp
+string FrameName(const string& output, int frame)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "_%03d", frame);
+    size_t dot = output.find_last_of('.');
+    if (dot == string::npos)
+        return output + number;
+    return output.substr(0, dot) + number + output.substr(dot);
+}
+
+int CompareImages(const string& pathA, const string& pathB)
+{
+    Image a(0, 0), b(0, 0);
+    if (!a.Load(pathA) || !b.Load(pathB))
+        return 1;
+    if (a.Width != b.Width || a.Height != b.Height) {
+        cout << "ERROR::COMPARE::SIZE_MISMATCH " << a.Width << "x" << a.Height << " vs " << b.Width << "x" << b.Height << endl;
+        return 1;
+    }
+
+    double sum = 0.0;
+    int largest = 0;
+    size_t above = 0;
+    for (size_t i = 0; i < a.Pixels.size(); i++)
+    {
+        int difference = abs((int)a.Pixels[i] - (int)b.Pixels[i]);
+        sum += difference;
+        largest = max(largest, difference);
+        if (difference > 8)
+            above++;
+    }
+    cout << "mean abs " << sum / (double)a.Pixels.size() << ", max " << largest << ", "
+        << above << " channels > 8" << endl;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && string(argv[1]) == "--compare") {
+        if (argc != 4) {
+            cout << "ERROR::ARGS::COMPARE_NEEDS_TWO_IMAGES" << endl;
+            return 1;
+        }
+        return CompareImages(argv[2], argv[3]);
+    }
+
+    // Split options from positional arguments
+    vector<string> args;
+    bool usePackets = false;
+    glm::vec3 position = glm::vec3(0.0f);
+    int threads = 0;
+    Integrator method = DORMAND_PRINCE;
+    MarchSettings march;
+    int tableSize = 4096;
+    string tablesFile, bakeFile, skyboxFile;
+    int rows = 256;
+    double minRadius = 0.2, maxRadius = 100.0;
+    int coarseTile = 0;
+    double coarseTolerance = 1e-5;
+    int frames = 1;
+    double frameTime = 1.0 / 30.0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--packet")
+            usePackets = true;
+        else if (arg == "--position" && i + 3 < argc) {
+            position.x = (GLfloat)atof(argv[++i]);
+            position.y = (GLfloat)atof(argv[++i]);
+            position.z = (GLfloat)atof(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (arg == "--integrator" && i + 1 < argc) {
+            string name = argv[++i];
+            if (name == "march")
+                method = SPHERE_TRACE;
+            else if (name == "fixed")
+                method = FIXED_STEP;
+            else if (name == "rk45")
+                method = DORMAND_PRINCE;
+            else if (name == "table")
+                method = LOOKUP_TABLE;
+            else {
+                cout << "ERROR::ARGS::UNKNOWN_INTEGRATOR " << name << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--tolerance" && i + 1 < argc)
+            march.Tolerance = atof(argv[++i]);
+        else if (arg == "--step" && i + 1 < argc)
+            march.StepSize = atof(argv[++i]);
+        else if (arg == "--max-steps" && i + 1 < argc)
+            march.MaxGeodesicSteps = atoi(argv[++i]);
+        else if (arg == "--far-field" && i + 1 < argc)
+            march.FarField = atof(argv[++i]);
+        else if (arg == "--table-size" && i + 1 < argc)
+            tableSize = atoi(argv[++i]);
+        else if (arg == "--tables" && i + 1 < argc)
+            tablesFile = argv[++i];
+        else if (arg == "--bake-tables" && i + 1 < argc)
+            bakeFile = argv[++i];
+        else if (arg == "--rows" && i + 1 < argc)
+            rows = atoi(argv[++i]);
+        else if (arg == "--radii" && i + 2 < argc) {
+            minRadius = atof(argv[++i]);
+            maxRadius = atof(argv[++i]);
+        }
+        else if (arg == "--coarse" && i + 1 < argc)
+            coarseTile = atoi(argv[++i]);
+        else if (arg == "--coarse-tolerance" && i + 1 < argc)
+            coarseTolerance = atof(argv[++i]);
+        else if (arg == "--frames" && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (arg == "--frame-time" && i + 1 < argc)
+            frameTime = atof(argv[++i]);
+        else if (arg == "--bake-skybox" && i + 1 < argc)
+            skyboxFile = argv[++i];
+        else if (arg.compare(0, 2, "--") == 0) {
+            cout << "ERROR::ARGS::UNKNOWN_OPTION " << arg << endl;
+            return 1;
+        }
+        else
+            args.push_back(arg);
+    }
+
+    string output = args.size() > 0 ? args[0] : "blackhole.bmp";
+    int width = args.size() > 1 ? atoi(args[1].c_str()) : 1600;
+    int height = args.size() > 2 ? atoi(args[2].c_str()) : 900;
+    double time = args.size() > 3 ? atof(args[3].c_str()) : 0.0;    // seconds, as returned by glfwGetTime()
+    GLfloat yaw = args.size() > 4 ? (GLfloat)atof(args[4].c_str()) : YAW;
+    GLfloat pitch = args.size() > 5 ? (GLfloat)atof(args[5].c_str()) : PITCH;
+    string skyboxDir = args.size() > 6 ? args[6] : "resources/skybox";
+
+    if (width <= 0 || height <= 0) {
+        cout << "ERROR::ARGS::BAD_IMAGE_SIZE" << endl;
+        return 1;
+    }
+    if (frames <= 0) {
+        cout << "ERROR::ARGS::BAD_FRAME_COUNT" << endl;
+        return 1;
+    }
+    if (threads < 0) {
+        cout << "ERROR::ARGS::BAD_THREAD_COUNT" << endl;
+        return 1;
+    }
+    if (march.Tolerance <= 0.0 || march.StepSize <= 0.0 || march.MaxGeodesicSteps <= 0 || march.FarField < 0.0 || tableSize <= 0 || coarseTile < 0 || coarseTolerance < 0.0) {
+        cout << "ERROR::ARGS::BAD_INTEGRATOR_SETTINGS" << endl;
+        return 1;
+    }
+
+    unique_ptr<ThreadPool> pool;
+    if (threads != 1)
+        pool.reset(new ThreadPool(threads));
+
+    // Offline pass for fly-throughs: a table row for every radius the camera may pass
+    if (!bakeFile.empty()) {
+        if (rows <= 0 || minRadius <= 0.0 || maxRadius < minRadius) {
+            cout << "ERROR::ARGS::BAD_TABLE_RADII" << endl;
+            return 1;
+        }
+        CpuRenderer tracer(nullptr, CreateRayCamera(ZOOM, 1.0), glm::dmat3(1.0), 0.0);
+        tracer.March = DeflectionTableSettings();
+        DeflectionTable table;
+        auto start = chrono::steady_clock::now();
+        tracer.BuildDeflectionTable(table, tableSize, rows, minRadius, maxRadius, pool.get());
+        cout << rows << " x " << tableSize << " texel deflection tables built in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+        return table.Save(bakeFile, tracer.Hole.radius) ? 0 : 1;
+    }
+
+    // Cubemap (Skybox), same face order as loadCubemap
+    vector<string> faces;
+    faces.push_back(skyboxDir + "/right.png");
+    faces.push_back(skyboxDir + "/left.png");
+    faces.push_back(skyboxDir + "/top.png");
+    faces.push_back(skyboxDir + "/bottom.png");
+    faces.push_back(skyboxDir + "/front.png");
+    faces.push_back(skyboxDir + "/back.png");
+    Cubemap skybox;
+    if (!skybox.Load(faces, pool.get()))
+        return 1;
+
+    // Offline pass for the viewer: the compressed cubemap it uploads without decoding
+    if (!skyboxFile.empty()) {
+        auto start = chrono::steady_clock::now();
+        if (!skybox.SaveDDS(skyboxFile, pool.get()))
+            return 1;
+        cout << skybox.Width << "x" << skybox.Height << " skybox compressed in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+        return 0;
+    }
+
+    // Camera
+    Camera camera(position, glm::vec3(0.0f, 1.0f, 0.0f), yaw, pitch);
+    glm::dmat3 view = glm::dmat3(glm::mat3(camera.GetViewMatrix()));    // Remove any translation component of the view matrix
+    RayCamera eye = CreateRayCamera(camera.Zoom, (double)width / (double)height);
+
+    CpuRenderer renderer(&skybox, eye, view, time * 0.07);
+    renderer.Hole.center = view * (HOLE_POSITION - glm::dvec3(position));
+    renderer.UsePackets = usePackets;
+    renderer.Method = method;
+    renderer.CoarseTile = coarseTile;
+    renderer.CoarseTolerance = coarseTolerance;
+
+    DeflectionTable table;
+    if (method == LOOKUP_TABLE) {
+        double radius = glm::length(renderer.Hole.center);
+        if (!tablesFile.empty()) {
+            if (!table.Load(tablesFile, renderer.Hole.radius))
+                return 1;
+            if (!table.Covers(radius)) {
+                cout << "ERROR::DEFLECTION_TABLE::RADIUS_NOT_COVERED " << radius << endl;
+                return 1;
+            }
+        }
+        else {
+            renderer.March = DeflectionTableSettings();
+            auto start = chrono::steady_clock::now();
+            renderer.BuildDeflectionTable(table, tableSize, 1, radius, radius, pool.get());
+            cout << tableSize << " texel deflection table built in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+        }
+        renderer.Table = &table;
+    }
+    renderer.March = march;
+    Image image(width, height);
+
+    // Static camera animation: geometry pass once, then a shading pass per frame
+    if (frames > 1) {
+        GeometryBuffer geometry(width, height);
+        auto start = chrono::steady_clock::now();
+        renderer.TraceGeometry(geometry, pool.get());
+        cout << width << "x" << height << " geometry pass in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+        start = chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            renderer.Time = (time + frame * frameTime) * 0.07;
+            renderer.ShadeGeometry(geometry, image, pool.get());
+            if (!image.Save(FrameName(output, frame)))
+                return 1;
+        }
+        cout << frames << " frames shaded and saved in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+        return 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    renderer.Render(image, pool.get());
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << width << "x" << height << " rendered in " << seconds << " s ("
+        << (double)width * height / seconds / 1e6 << " Mrays/s";
+    if (usePackets)
+        cout << ", " << PACKET_SIZE << "-wide packets";
+    if (pool)
+        cout << ", " << pool->Size() << " threads";
+    cout << ")" << endl;
+    if (renderer.RayCount > 0)
+        cout << renderer.StepCount << " integration steps, " << (double)renderer.StepCount / renderer.RayCount << " per ray" << endl;
+    if (coarseTile > 0)
+        cout << renderer.RayCount << " rays traced, " << 100.0 * renderer.RayCount / ((double)width * height) << "% of the pixels" << endl;
+
+    return image.Save(output) ? 0 : 1;
+}
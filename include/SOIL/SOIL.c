@@ -15,7 +15,7 @@
 
 #define SOIL_CHECK_FOR_GL_ERRORS 0
 
-#ifdef WIN32
+#if defined(WIN32) || defined(_WIN32)
 	#define WIN32_LEAN_AND_MEAN
 	#include <windows.h>
 	#include <wingdi.h>
@@ -38,8 +38,13 @@
 #include <stdlib.h>
 #include <string.h>
 
-/*	error reporting	*/
-char *result_string_pointer = "SOIL initialized";
+/*	error reporting, per thread as images are loaded on several threads at once	*/
+#ifdef _MSC_VER
+	#define SOIL_THREAD_LOCAL __declspec(thread)
+#else
+	#define SOIL_THREAD_LOCAL __thread
+#endif
+SOIL_THREAD_LOCAL char *result_string_pointer = "SOIL initialized";
 
 /*	for loading cube maps	*/
 enum{
@@ -1964,7 +1969,7 @@ int query_DXT_capability( void )
 		{
 			/*	and find the address of the extension function	*/
 			P_SOIL_GLCOMPRESSEDTEXIMAGE2DPROC ext_addr = NULL;
-			#ifdef WIN32
+			#if defined(WIN32) || defined(_WIN32)
 				ext_addr = (P_SOIL_GLCOMPRESSEDTEXIMAGE2DPROC)
 						wglGetProcAddress
 						(
@@ -19,6 +19,17 @@
 	method fails for finding the largest eigenvector	*/
 #define USE_COV_MAT	1
 
+/*	SSE2 versions of the per block loops, used where SSE2 is always
+	there (x64, or when the compiler is told so).  They do the same
+	float operations in the same order as the scalar code, so the
+	compressed output is bit for bit the same.	*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_SSE2	1
+#include <emmintrin.h>
+#else
+#define USE_SSE2	0
+#endif
+
 /********* Function Prototypes *********/
 /*
 	Takes a 4x4 block of pixels and compresses it into 8 bytes
@@ -275,6 +286,16 @@ unsigned char* convert_image_to_DXT5(
 }
 
 /********* Helper Functions *********/
+#if USE_SSE2
+/*	adds up the 4 lanes	*/
+static int sum_epi32( __m128i v )
+{
+	v = _mm_add_epi32( v, _mm_shuffle_epi32( v, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	v = _mm_add_epi32( v, _mm_shuffle_epi32( v, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	return _mm_cvtsi128_si32( v );
+}
+#endif
+
 int convert_bit_range( int c, int from_bits, int to_bits )
 {
 	int b = (1 << (from_bits - 1)) + c * ((1 << to_bits) - 1);
@@ -308,6 +329,36 @@ void compute_color_line_STDEV(
 	float sum_rg = 0.0f, sum_rb = 0.0f, sum_gb = 0.0f;
 	/*	calculate all data needed for the covariance matrix
 		( to compare with _rygdxt code)	*/
+	#if USE_SSE2
+	/*	all of the sums are integers below 2^24, so summing them
+		as integers gives exactly what the float sums give	*/
+	{
+		short r[16], g[16], b[16];
+		__m128i r0, r1, g0, g1, b0, b1, ones;
+		for( i = 0; i < 16; ++i )
+		{
+			r[i] = uncompressed[i*channels+0];
+			g[i] = uncompressed[i*channels+1];
+			b[i] = uncompressed[i*channels+2];
+		}
+		r0 = _mm_loadu_si128( (const __m128i*)r );
+		r1 = _mm_loadu_si128( (const __m128i*)(r+8) );
+		g0 = _mm_loadu_si128( (const __m128i*)g );
+		g1 = _mm_loadu_si128( (const __m128i*)(g+8) );
+		b0 = _mm_loadu_si128( (const __m128i*)b );
+		b1 = _mm_loadu_si128( (const __m128i*)(b+8) );
+		ones = _mm_set1_epi16( 1 );
+		sum_r = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( r0, ones ), _mm_madd_epi16( r1, ones ) ) );
+		sum_g = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( g0, ones ), _mm_madd_epi16( g1, ones ) ) );
+		sum_b = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( b0, ones ), _mm_madd_epi16( b1, ones ) ) );
+		sum_rr = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( r0, r0 ), _mm_madd_epi16( r1, r1 ) ) );
+		sum_gg = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( g0, g0 ), _mm_madd_epi16( g1, g1 ) ) );
+		sum_bb = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( b0, b0 ), _mm_madd_epi16( b1, b1 ) ) );
+		sum_rg = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( r0, g0 ), _mm_madd_epi16( r1, g1 ) ) );
+		sum_rb = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( r0, b0 ), _mm_madd_epi16( r1, b1 ) ) );
+		sum_gb = (float)sum_epi32( _mm_add_epi32( _mm_madd_epi16( g0, b0 ), _mm_madd_epi16( g1, b1 ) ) );
+	}
+	#else
 	for( i = 0; i < 16*channels; i += channels )
 	{
 		sum_r += uncompressed[i+0];
@@ -320,6 +371,7 @@ void compute_color_line_STDEV(
 		sum_rb += uncompressed[i+0] * uncompressed[i+2];
 		sum_gb += uncompressed[i+1] * uncompressed[i+2];
 	}
+	#endif
 	/*	convert the sums to averages	*/
 	sum_r *= inv_16;
 	sum_g *= inv_16;
@@ -431,6 +483,47 @@ void LSE_master_colors_max_min(
 	vec_len2 = 1.0f / ( 0.00001f +
 			sum_x2[0]*sum_x2[0] + sum_x2[1]*sum_x2[1] + sum_x2[2]*sum_x2[2] );
 	/*	finding the max and min vector values	*/
+	#if USE_SSE2
+	{
+		float r[16], g[16], b[16], lo[4], hi[4];
+		__m128 dr, dg, db, d, vmin, vmax;
+		for( i = 0; i < 16; ++i )
+		{
+			r[i] = uncompressed[i*channels+0];
+			g[i] = uncompressed[i*channels+1];
+			b[i] = uncompressed[i*channels+2];
+		}
+		dr = _mm_set1_ps( sum_x2[0] );
+		dg = _mm_set1_ps( sum_x2[1] );
+		db = _mm_set1_ps( sum_x2[2] );
+		vmin = _mm_set1_ps( 3.0e38f );
+		vmax = _mm_set1_ps( -3.0e38f );
+		for( i = 0; i < 16; i += 4 )
+		{
+			d = _mm_add_ps( _mm_add_ps(
+					_mm_mul_ps( dr, _mm_loadu_ps( r+i ) ),
+					_mm_mul_ps( dg, _mm_loadu_ps( g+i ) ) ),
+					_mm_mul_ps( db, _mm_loadu_ps( b+i ) ) );
+			vmin = _mm_min_ps( vmin, d );
+			vmax = _mm_max_ps( vmax, d );
+		}
+		_mm_storeu_ps( lo, vmin );
+		_mm_storeu_ps( hi, vmax );
+		dot_min = lo[0];
+		dot_max = hi[0];
+		for( i = 1; i < 4; ++i )
+		{
+			if( lo[i] < dot_min )
+			{
+				dot_min = lo[i];
+			}
+			if( hi[i] > dot_max )
+			{
+				dot_max = hi[i];
+			}
+		}
+	}
+	#else
 	dot_max =
 			(
 				sum_x2[0] * uncompressed[0] +
@@ -454,6 +547,7 @@ void LSE_master_colors_max_min(
 			dot_max = dot;
 		}
 	}
+	#endif
 	/*	and the offset (from the average location)	*/
 	dot = sum_x2[0]*sum_x[0] + sum_x2[1]*sum_x[1] + sum_x2[2]*sum_x[2];
 	dot_min -= dot;
@@ -548,6 +642,45 @@ void
 	dot_offset = color_line[0]*c0[0] + color_line[1]*c0[1] + color_line[2]*c0[2];
 	/*	store the rest of the bits	*/
 	next_bit = 8*4;
+	#if USE_SSE2
+	{
+		float r[16], g[16], b[16];
+		short values[16];
+		__m128 cr, cg, cb, offset, three, half;
+		__m128i v[4], zero, top;
+		for( i = 0; i < 16; ++i )
+		{
+			r[i] = uncompressed[i*channels+0];
+			g[i] = uncompressed[i*channels+1];
+			b[i] = uncompressed[i*channels+2];
+		}
+		cr = _mm_set1_ps( color_line[0] );
+		cg = _mm_set1_ps( color_line[1] );
+		cb = _mm_set1_ps( color_line[2] );
+		offset = _mm_set1_ps( dot_offset );
+		three = _mm_set1_ps( 3.0f );
+		half = _mm_set1_ps( 0.5f );
+		for( i = 0; i < 4; ++i )
+		{
+			__m128 dot_product = _mm_sub_ps( _mm_add_ps( _mm_add_ps(
+					_mm_mul_ps( cr, _mm_loadu_ps( r+4*i ) ),
+					_mm_mul_ps( cg, _mm_loadu_ps( g+4*i ) ) ),
+					_mm_mul_ps( cb, _mm_loadu_ps( b+4*i ) ) ),
+					offset );
+			/*	map to [0,3], truncating like the (int) cast	*/
+			v[i] = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( dot_product, three ), half ) );
+		}
+		zero = _mm_setzero_si128();
+		top = _mm_set1_epi16( 3 );
+		_mm_storeu_si128( (__m128i*)values, _mm_min_epi16( _mm_max_epi16( _mm_packs_epi32( v[0], v[1] ), zero ), top ) );
+		_mm_storeu_si128( (__m128i*)(values+8), _mm_min_epi16( _mm_max_epi16( _mm_packs_epi32( v[2], v[3] ), zero ), top ) );
+		for( i = 0; i < 16; ++i )
+		{
+			compressed[next_bit >> 3] |= swizzle4[ values[i] ] << (next_bit & 7);
+			next_bit += 2;
+		}
+	}
+	#else
 	for( i = 0; i < 16; ++i )
 	{
 		/*	find the dot product of this color, to place it on the line
@@ -571,6 +704,7 @@ void
 		compressed[next_bit >> 3] |= swizzle4[ next_value ] << (next_bit & 7);
 		next_bit += 2;
 	}
+	#endif
 	/*	done compressing to DXT1	*/
 }
 
@@ -114,8 +114,13 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 // Generic API that works on all image types
 //
 
-// this is not threadsafe
-static char *failure_reason;
+// per thread, images are decoded on several threads at once
+#ifdef _MSC_VER
+#define STBI_THREAD_LOCAL __declspec(thread)
+#else
+#define STBI_THREAD_LOCAL __thread
+#endif
+static STBI_THREAD_LOCAL char *failure_reason;
 
 char *stbi_failure_reason(void)
 {
@@ -1815,7 +1820,7 @@ static int parse_huffman_block(zbuf *a)
 static int compute_huffman_codes(zbuf *a)
 {
    static uint8 length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   static zhuffman z_codelength; // static just to save stack space
+   zhuffman z_codelength; // not static, images may be decoded on several threads at once
    uint8 lencodes[286+32+137];//padding for maximum single op
    uint8 codelength_sizes[19];
    int i,n;
@@ -1900,9 +1905,8 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// filled per block instead of once into statics, so that threads never see them half done
+static void init_defaults(uint8 *default_length, uint8 *default_distance)
 {
    int i;   // use <= to match clearly with spec
    for (i=0; i <= 143; ++i)     default_length[i]   = 8;
@@ -1930,7 +1934,8 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
+            uint8 default_length[288], default_distance[32];
+            init_defaults(default_length, default_distance);
             if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
             if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
          } else {
@@ -0,0 +1,8 @@
+#version 330 core
+out vec4 color;
+
+// only the stencil buffer is written, see the geometry pass in blackhole.cpp
+void main()
+{
+    color = vec4(0.0);
+}
\ No newline at end of file